@@ -1,5 +1,7 @@
+#ifndef RT2_HEADLESS
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#endif
 
 #include <iostream>
 #include <vector>
@@ -7,9 +9,49 @@
 #include <cmath>
 #include <cstdint>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <new>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <fstream>
+#include <map>
+#include <set>
+#include <filesystem>
+#include <charconv>
+#include <bitset>
+#include <cstdio>
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+#include <csignal>
+#include <cerrno>
+#if defined(__unix__) || defined(__APPLE__)
+#define RT2_SERVICE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RT2_X86_SIMD
+#include <immintrin.h>
+#endif
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#include "rt2_net.h"
+#include "rt2_percentile.h"
 
+#ifndef RT2_HEADLESS
 const char* vertexShaderSource = R"glsl(
 #version 330 core
 layout (location=0) in vec2 aPos;
@@ -30,15 +72,38 @@ void main() {
     FragColor = texture(screenTexture, TexCoord);
 }
 )glsl";
+#endif
 
 bool isPerspective = true;
+bool useBVH = true;
+bool useWavefront = true;
+bool orbiting = true;
+bool animating = true;
 
+#ifndef RT2_HEADLESS
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
     if (key == GLFW_KEY_P && action == GLFW_PRESS) {
         isPerspective = !isPerspective;
         std::cout << "Switched to " << (isPerspective ? "Perspective" : "Orthographic") << " view." << std::endl;
     }
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        useBVH = !useBVH;
+        std::cout << "Switched to " << (useBVH ? "BVH" : "linear scan") << " traversal." << std::endl;
+    }
+    if (key == GLFW_KEY_W && action == GLFW_PRESS) {
+        useWavefront = !useWavefront;
+        std::cout << "Switched to " << (useWavefront ? "wavefront" : "recursive") << " tracing." << std::endl;
+    }
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        orbiting = !orbiting;
+        std::cout << (orbiting ? "Camera orbiting." : "Camera held still.") << std::endl;
+    }
+    if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+        animating = !animating;
+        std::cout << (animating ? "Spheres moving." : "Spheres paused.") << std::endl;
+    }
 }
+#endif
 
 
 struct Vec3 {
@@ -54,6 +119,7 @@ struct Vec3 {
     Vec3 operator*(const Vec3 &b) const {
         return Vec3(x * b.x, y * b.y, z * b.z);
     }
+    float operator[](int i) const { return (&x)[i]; }
     float dot(const Vec3 &b) const { return x*b.x + y*b.y + z*b.z;}
     float length() const { return std::sqrt(x*x+y*y+z*z);}
     Vec3 normalize() const { float len=length(); return (*this)*(1.f/len);}
@@ -75,9 +141,71 @@ struct Sphere {
     float radius;
     uint8_t r,g,b;
 };
-struct Triangle {
-    Vec3 v0,v1,v2;
+// Indexed triangle mesh: every vertex is stored once and shared by the triangles that
+// use it, which refer to it by index. The colour belongs to the whole mesh.
+struct Mesh {
+    std::vector<Vec3> vertices;
+    std::vector<uint32_t> indices; // three per triangle
     uint8_t r,g,b;
+    size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// Affine transform; each row of m is a row of the 3x3 linear part followed by the translation
+struct Transform {
+    float m[3][4] = {{1,0,0,0}, {0,1,0,0}, {0,0,1,0}};
+
+    Vec3 point(const Vec3 &p) const {
+        return Vec3(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+                    m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+                    m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+    }
+    Vec3 vector(const Vec3 &v) const {
+        return Vec3(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                    m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                    m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+    }
+    // The transposed linear part; applied by the inverse transform it carries normals over
+    Vec3 transposedVector(const Vec3 &v) const {
+        return Vec3(m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z,
+                    m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z,
+                    m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z);
+    }
+    Transform inverse() const;
+    // Uniform scale, then a turn about the y axis, then a move to position
+    static Transform place(const Vec3 &position, float yaw, float scale);
+};
+
+Transform Transform::inverse() const {
+    // Adjugate over determinant for the linear part, then the translation taken back
+    Transform inv;
+    float det = m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+              - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+              + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    float invDet = 1.f / det;
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            int r1 = (c + 1) % 3, r2 = (c + 2) % 3, c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+            inv.m[r][c] = (m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) * invDet;
+        }
+    }
+    Vec3 t = inv.vector(Vec3(m[0][3], m[1][3], m[2][3]));
+    inv.m[0][3] = -t.x; inv.m[1][3] = -t.y; inv.m[2][3] = -t.z;
+    return inv;
+}
+
+Transform Transform::place(const Vec3 &position, float yaw, float scale) {
+    float c = std::cos(yaw) * scale, s = std::sin(yaw) * scale;
+    Transform t;
+    t.m[0][0] = c;  t.m[0][1] = 0.f;   t.m[0][2] = s;  t.m[0][3] = position.x;
+    t.m[1][0] = 0.f; t.m[1][1] = scale; t.m[1][2] = 0.f; t.m[1][3] = position.y;
+    t.m[2][0] = -s; t.m[2][1] = 0.f;   t.m[2][2] = c;  t.m[2][3] = position.z;
+    return t;
+}
+
+// One copy of a mesh, placed by an object-to-world transform
+struct Instance {
+    int mesh; // index into World::meshes
+    Transform transform;
 };
 
 struct Plane {
@@ -98,12 +226,143 @@ struct Light {
     Vec3 color;
 };
 
+// Allocator for float arrays that SIMD code can load with aligned loads
+template <typename T, size_t Align = 32>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Align)); }
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+typedef std::vector<float, AlignedAllocator<float>> FloatArray;
+
+struct Color8 {
+    uint8_t r,g,b;
+};
+
+// Axis-aligned bounding box
+struct AABB {
+    Vec3 min{ 1e30f, 1e30f, 1e30f};
+    Vec3 max{-1e30f,-1e30f,-1e30f};
+    void grow(const Vec3 &p) {
+        min = Vec3(std::min(min.x,p.x), std::min(min.y,p.y), std::min(min.z,p.z));
+        max = Vec3(std::max(max.x,p.x), std::max(max.y,p.y), std::max(max.z,p.z));
+    }
+    void grow(const AABB &b) {
+        min = Vec3(std::min(min.x,b.min.x), std::min(min.y,b.min.y), std::min(min.z,b.min.z));
+        max = Vec3(std::max(max.x,b.max.x), std::max(max.y,b.max.y), std::max(max.z,b.max.z));
+    }
+    float area() const {
+        if (max.x < min.x) return 0.f; // empty
+        Vec3 e = max - min;
+        return 2.f * (e.x*e.y + e.y*e.z + e.z*e.x);
+    }
+};
+
+struct BVH;
+
+// Per-frame compiled form of the spheres and meshes. Every sphere field lives in its own
+// aligned array, so the intersection loops only pull the fields they read into cache.
+// The meshes are merged into one indexed vertex buffer: a triangle costs 12 bytes of
+// indices plus its share of the vertices, and its edges and normal are worked out from
+// the corners when it is tested or hit. Instances keep only their mesh and transform:
+// rays are moved into the mesh's own coordinates and traced through its bottom-level
+// BVH, which every copy of the mesh shares.
+struct CompiledScene {
+    struct SphereArrays {
+        FloatArray cx, cy, cz;
+        FloatArray radius, radius2;
+    } spheres;
+    struct TriangleArrays {
+        std::vector<Vec3> vertices;    // every mesh's vertices, one mesh after another
+        std::vector<uint32_t> indices; // three per triangle, into vertices
+        std::vector<int> meshStart;    // first triangle of each mesh
+        // Corner v0 and the edges v1 - v0 and v2 - v0 that the intersection tests use
+        void corners(int i, Vec3 &v0, Vec3 &e1, Vec3 &e2) const {
+            const uint32_t *tri = &indices[size_t(i) * 3];
+            v0 = vertices[tri[0]];
+            e1 = vertices[tri[1]] - v0;
+            e2 = vertices[tri[2]] - v0;
+        }
+    } triangles;
+    struct InstanceArrays {
+        std::vector<int> mesh;
+        std::vector<Transform> toObject;
+        std::vector<AABB> bounds; // in the world; set when the mesh BVHs are built
+    } instances;
+    std::vector<Color8> sphereColors, meshColors;
+    std::vector<char> meshInstanced; // drawn only through instances, not where it stands
+    std::vector<BVH> meshBVH;        // bottom level, built for instanced meshes only
+
+    int sphereCount() const { return (int)spheres.cx.size(); }
+    int triangleCount() const { return int(triangles.indices.size() / 3); }
+    int meshCount() const { return (int)triangles.meshStart.size(); }
+    int instanceCount() const { return (int)instances.mesh.size(); }
+    int meshEnd(int mesh) const { return mesh + 1 < meshCount() ? triangles.meshStart[mesh + 1] : triangleCount(); }
+    // Mesh the triangle belongs to
+    int meshOf(int i) const { return int(std::upper_bound(triangles.meshStart.begin(), triangles.meshStart.end(), i) - triangles.meshStart.begin()) - 1; }
+    void compile(const std::vector<Sphere> &sphereList, std::vector<Mesh> &meshList, const std::vector<Instance> &instanceList);
+    // Bytes held for the triangles: the merged vertex buffer and the indices
+    size_t triangleBytes() const { return triangles.vertices.size() * sizeof(Vec3) + triangles.indices.size() * sizeof(uint32_t); }
+    void updateSphere(int i, const Sphere &s);
+};
+
+// The meshes' vertices and indices are moved into the merged buffer and released from
+// meshList, so every triangle is held once; the meshes keep only their colour.
+void CompiledScene::compile(const std::vector<Sphere> &sphereList, std::vector<Mesh> &meshList, const std::vector<Instance> &instanceList) {
+    // resize() keeps capacity, so recompiling every frame does not reallocate
+    size_t ns = sphereList.size();
+    for (FloatArray *a : {&spheres.cx, &spheres.cy, &spheres.cz, &spheres.radius, &spheres.radius2}) a->resize(ns);
+    sphereColors.resize(ns);
+    for (size_t i = 0; i < ns; ++i) updateSphere((int)i, sphereList[i]);
+
+    TriangleArrays &t = triangles;
+    t.vertices.clear(); t.indices.clear(); t.meshStart.clear(); meshColors.clear();
+    for (Mesh &mesh : meshList) {
+        uint32_t base = uint32_t(t.vertices.size());
+        t.meshStart.push_back(triangleCount());
+        if (base == 0 && t.indices.empty()) {
+            // The first mesh's buffers are taken over as they are
+            t.vertices = std::move(mesh.vertices);
+            t.indices = std::move(mesh.indices);
+        } else {
+            t.vertices.insert(t.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            for (uint32_t index : mesh.indices) t.indices.push_back(base + index);
+        }
+        mesh.vertices = std::vector<Vec3>();
+        mesh.indices = std::vector<uint32_t>();
+        meshColors.push_back({mesh.r, mesh.g, mesh.b});
+    }
+
+    meshInstanced.assign(meshList.size(), 0);
+    instances.mesh.clear(); instances.toObject.clear();
+    for (const Instance &instance : instanceList) {
+        instances.mesh.push_back(instance.mesh);
+        instances.toObject.push_back(instance.transform.inverse());
+        meshInstanced[instance.mesh] = 1;
+    }
+    instances.bounds.assign(instanceList.size(), AABB());
+}
+
+// Refreshes one sphere in place, for objects that move between frames
+void CompiledScene::updateSphere(int i, const Sphere &s) {
+    spheres.cx[i] = s.center.x; spheres.cy[i] = s.center.y; spheres.cz[i] = s.center.z;
+    spheres.radius[i] = s.radius;
+    spheres.radius2[i] = s.radius * s.radius;
+    sphereColors[i] = {s.r, s.g, s.b};
+}
+
 // Ray-object intersection 
-bool intersectSphere(const Ray &ray, const Sphere &sph, float &t) {
-    Vec3 oc=ray.origin - sph.center;
+bool intersectSphere(const Ray &ray, const CompiledScene &scene, int i, float &t) {
+    const CompiledScene::SphereArrays &sph = scene.spheres;
+    Vec3 oc=ray.origin - Vec3(sph.cx[i], sph.cy[i], sph.cz[i]);
     float a=1.0f; 
     float b=2.0f*ray.direction.dot(oc);
-    float c=oc.dot(oc)-sph.radius*sph.radius;
+    float c=oc.dot(oc)-sph.radius2[i];
     float disc=b*b -4*a*c;
     if(disc<0) return false;
     float sq=sqrtf(disc);
@@ -113,15 +372,15 @@ bool intersectSphere(const Ray &ray, const Sphere &sph, float &t) {
     if(t1 > 0.001f) { t=t1; return true;}
     return false;
 }
-bool intersectTriangle(const Ray &ray, const Triangle &tri, float &t) {
+bool intersectTriangle(const Ray &ray, const CompiledScene &scene, int i, float &t) {
     const float EPSILON = 1e-7f;
-    Vec3 edge1 = tri.v1 - tri.v0;
-    Vec3 edge2 = tri.v2 - tri.v0;
+    Vec3 v0, edge1, edge2;
+    scene.triangles.corners(i, v0, edge1, edge2);
     Vec3 h = ray.direction.cross(edge2);
     float a = edge1.dot(h);
     if (std::abs(a) < EPSILON) return false; // parallel
     float f = 1.0f / a;
-    Vec3 s = ray.origin - tri.v0;
+    Vec3 s = ray.origin - v0;
     float u = f * s.dot(h);
     if (u < 0.0f || u > 1.0f) return false;
     Vec3 q = s.cross(edge1);
@@ -135,6 +394,38 @@ bool intersectTriangle(const Ray &ray, const Triangle &tri, float &t) {
     return false;
 }
 
+// Any-hit variants for shadow rays: only report whether a hit lies in (epsilon, tMax)
+bool occludesSphere(const Ray &ray, const CompiledScene &scene, int i, float tMax) {
+    const CompiledScene::SphereArrays &sph = scene.spheres;
+    Vec3 oc=ray.origin - Vec3(sph.cx[i], sph.cy[i], sph.cz[i]);
+    float b=2.0f*ray.direction.dot(oc);
+    float c=oc.dot(oc)-sph.radius2[i];
+    float disc=b*b -4*c;
+    if(disc<0) return false;
+    float sq=sqrtf(disc);
+    float t0=(-b - sq)/2.f;
+    if(t0 > 0.001f) return t0 < tMax;
+    float t1=(-b + sq)/2.f;
+    return t1 > 0.001f && t1 < tMax;
+}
+bool occludesTriangle(const Ray &ray, const CompiledScene &scene, int i, float tMax) {
+    const float EPSILON = 1e-7f;
+    Vec3 v0, edge1, edge2;
+    scene.triangles.corners(i, v0, edge1, edge2);
+    Vec3 h = ray.direction.cross(edge2);
+    float a = edge1.dot(h);
+    if (std::abs(a) < EPSILON) return false; // parallel
+    float f = 1.0f / a;
+    Vec3 s = ray.origin - v0;
+    float u = f * s.dot(h);
+    if (u < 0.0f || u > 1.0f) return false;
+    Vec3 q = s.cross(edge1);
+    float v = f * ray.direction.dot(q);
+    if (v < 0.0f || u + v > 1.0f) return false;
+    float tempT = f * edge2.dot(q);
+    return tempT > EPSILON && tempT < tMax;
+}
+
 bool intersectPlane(const Ray& ray, const Plane& plane, float& t) {
     float denom = ray.direction.dot(plane.normal);
     if (fabs(denom) < 1e-6f) return false; // parallel
@@ -143,12 +434,14 @@ bool intersectPlane(const Ray& ray, const Plane& plane, float& t) {
     return (t > 0.001f);
 }
 
-Vec3 getSphereNormal(const Sphere &s, const Vec3 &point) {
-    return (point - s.center).normalize();
+Vec3 getSphereNormal(const CompiledScene &scene, int i, const Vec3 &point) {
+    return (point - Vec3(scene.spheres.cx[i], scene.spheres.cy[i], scene.spheres.cz[i])).normalize();
 }
 
-Vec3 getTriangleNormal(const Triangle &tri) {
-    return (tri.v1 - tri.v0).cross(tri.v2 - tri.v0).normalize();
+Vec3 getTriangleNormal(const CompiledScene &scene, int i) {
+    Vec3 v0, e1, e2;
+    scene.triangles.corners(i, v0, e1, e2);
+    return e1.cross(e2).normalize();
 }
 
 Vec3 reflect(const Vec3& I, const Vec3& N) {
@@ -156,323 +449,4328 @@ Vec3 reflect(const Vec3& I, const Vec3& N) {
 }
 
 
-Light light = { Vec3(2.f,5.f,5.f), Vec3(1.f,1.f,1.f) };
+// Bounding volume hierarchy over spheres, triangles and instances, built with a binned SAH
 
-Vec3 shade(const HitInfo &hit, const Ray &ray, const Light &light, const std::vector<Sphere> &spheres, const std::vector<Triangle> &triangles) {
-    Vec3 ambientColor(0.1f, 0.1f, 0.1f);
-    Vec3 objectColor(hit.r / 255.f, hit.g / 255.f, hit.b / 255.f);
+AABB sphereBounds(const CompiledScene &scene, int i) {
+    const CompiledScene::SphereArrays &s = scene.spheres;
+    Vec3 c(s.cx[i], s.cy[i], s.cz[i]), r(s.radius[i], s.radius[i], s.radius[i]);
+    AABB b; b.grow(c - r); b.grow(c + r);
+    return b;
+}
 
-    Vec3 lightDir = (light.position - hit.position).normalize();
+// Bounds of the triangle as the intersection test sees it, v0 + u*e1 + v*e2
+AABB triangleBounds(const CompiledScene &scene, int i) {
+    Vec3 v0, e1, e2;
+    scene.triangles.corners(i, v0, e1, e2);
+    AABB b; b.grow(v0);
+    b.grow(v0 + e1);
+    b.grow(v0 + e2);
+    return b;
+}
 
-    Ray shadowRay;
-    shadowRay.origin = hit.position + hit.normal * 0.001f;
-    shadowRay.direction = lightDir;
+// Slab test, returns the entry distance in tNear
+bool intersectAABB(const Ray &ray, const Vec3 &invDir, const AABB &box, float tMax, float &tNear) {
+    float tx1 = (box.min.x - ray.origin.x) * invDir.x, tx2 = (box.max.x - ray.origin.x) * invDir.x;
+    float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+    float ty1 = (box.min.y - ray.origin.y) * invDir.y, ty2 = (box.max.y - ray.origin.y) * invDir.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)); tmax = std::min(tmax, std::max(ty1, ty2));
+    float tz1 = (box.min.z - ray.origin.z) * invDir.z, tz2 = (box.max.z - ray.origin.z) * invDir.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)); tmax = std::min(tmax, std::max(tz1, tz2));
+    tNear = tmin;
+    return tmax >= std::max(tmin, 0.f) && tmin < tMax;
+}
 
-    float distToLight = (light.position - hit.position).length();
-    bool inShadow = false;
+enum PrimType { PRIM_SPHERE, PRIM_TRIANGLE, PRIM_INSTANCE };
 
-    for (const auto& s : spheres) {
-        float t;
-        if (intersectSphere(shadowRay, s, t)) {
-            if (t < distToLight) {
-                inShadow = true;
-                break;
-            }
-        }
-    }
+struct PrimRef {
+    PrimType type;
+    int index;
+};
 
-    if (!inShadow) {
-        for (const auto &tri : triangles) {
-            float t;
-            if (intersectTriangle(shadowRay, tri, t)) {
-                if (t < distToLight) {
-                    inShadow = true;
-                    break;
-                }
-            }
-        }
-    }
+AABB refBounds(const CompiledScene &scene, PrimRef ref) {
+    if (ref.type == PRIM_INSTANCE) return scene.instances.bounds[ref.index];
+    return ref.type == PRIM_SPHERE ? sphereBounds(scene, ref.index) : triangleBounds(scene, ref.index);
+}
 
-    if(inShadow) {
-        return objectColor * ambientColor;
+// Packet hits store the primitive itself as an int, so results from several BVHs can be
+// mixed: four times the index plus the PrimType, or plus INSTANCED_TRIANGLE for a
+// triangle reached through the instance that PacketHit::instance names
+const int INSTANCED_TRIANGLE = 3;
+int encodePrim(PrimRef ref) { return ref.index * 4 + ref.type; }
+PrimRef decodePrim(int id) { return {(id & 3) == PRIM_SPHERE ? PRIM_SPHERE : PRIM_TRIANGLE, id >> 2}; }
+
+// Instances trace their mesh's BVH, so these are defined after it
+bool occludesInstance(const Ray &ray, const CompiledScene &scene, int k, float tMax);
+
+bool occludesPrim(const Ray &ray, const CompiledScene &scene, PrimRef ref, float tMax) {
+    if (ref.type == PRIM_INSTANCE) return occludesInstance(ray, scene, ref.index, tMax);
+    return ref.type == PRIM_SPHERE ? occludesSphere(ray, scene, ref.index, tMax) : occludesTriangle(ray, scene, ref.index, tMax);
+}
+
+// Fill in position, normal and colour once the closest t is known. A triangle hit through
+// an instance has its normal in the mesh's coordinates and is turned into the world here.
+void setHitInfo(const Ray &ray, PrimRef ref, const CompiledScene &scene, HitInfo &hit, int instance = -1) {
+    hit.position = ray.origin + ray.direction * hit.t;
+    Color8 c;
+    if (ref.type == PRIM_SPHERE) {
+        hit.normal = getSphereNormal(scene, ref.index, hit.position);
+        c = scene.sphereColors[ref.index];
+    } else {
+        hit.normal = getTriangleNormal(scene, ref.index);
+        if (instance >= 0) hit.normal = scene.instances.toObject[instance].transposedVector(hit.normal).normalize();
+        c = scene.meshColors[scene.meshOf(ref.index)];
     }
+    hit.r = c.r; hit.g = c.g; hit.b = c.b;
+}
 
-    float diff = std::max(hit.normal.dot(lightDir), 0.0f);
-    Vec3 diffuse = objectColor * light.color * diff * 0.7f;
+// Inner node: count == 0, children at leftFirst and leftFirst+1.
+// Leaf: prims [leftFirst, leftFirst+count) of BVH::refs.
+struct BVHNode {
+    AABB bounds;
+    int leftFirst;
+    int count;
+};
 
-    Vec3 viewDir = (ray.origin - hit.position).normalize();
-    Vec3 reflectDir = (2.0f * hit.normal.dot(lightDir) * hit.normal - lightDir).normalize();
-    float spec = std::pow(std::max(viewDir.dot(reflectDir), 0.0f), 32);
-    Vec3 specular = light.color * spec * 0.2f;
+// Eight coherent rays in SoA layout. Unused lanes are disabled by a hit distance of 0.
+struct alignas(32) RayPacket {
+    static constexpr int SIZE = 8;
+    float ox[SIZE], oy[SIZE], oz[SIZE];
+    float dx[SIZE], dy[SIZE], dz[SIZE];
+    float idx[SIZE], idy[SIZE], idz[SIZE]; // reciprocal directions for the slab test
+};
 
-    Vec3 color = objectColor * ambientColor + diffuse + specular;
-    color.x = std::min(color.x, 1.f);
-    color.y = std::min(color.y, 1.f);
-    color.z = std::min(color.z, 1.f);
+// Closest hit per lane; id is whatever the caller passed to the kernel
+struct alignas(32) PacketHit {
+    float t[RayPacket::SIZE];
+    int id[RayPacket::SIZE];
+    int instance[RayPacket::SIZE]; // only meaningful when id is an INSTANCED_TRIANGLE
+};
 
-    return color;
+// Lanes in use, bit i for lane i; the spare lanes of a partial packet start with t = 0
+int activeLanes(const PacketHit &hit) {
+    int mask = 0;
+    for (int i = 0; i < RayPacket::SIZE; ++i) if (hit.t[i] > 0.f) mask |= 1 << i;
+    return mask;
 }
 
-Vec3 trace(const Ray& ray, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const Plane& plane, const Light& light, int depth = 0)
-{
-    if (depth > 2) return Vec3(0.1f,0.1f,0.1f); // recursion limit
+int laneCount(int mask) { return (int)std::bitset<RayPacket::SIZE>(mask).count(); }
 
-    HitInfo closestHit; 
-    closestHit.t = 1e20f; 
-    bool hitSomething = false;
+// Fill in lane i of a packet result, which hit something
+void setHitInfo(const Ray &ray, const PacketHit &packetHit, int i, const CompiledScene &scene, HitInfo &hit) {
+    int id = packetHit.id[i];
+    setHitInfo(ray, decodePrim(id), scene, hit, (id & 3) == INSTANCED_TRIANGLE ? packetHit.instance[i] : -1);
+}
 
-    for (const auto& s: spheres) {
-        float t;
-        if (intersectSphere(ray,s,t) && t < closestHit.t) {
-            closestHit.t = t;
-            closestHit.position = ray.origin + ray.direction * t;
-            closestHit.normal = (closestHit.position - s.center).normalize();
-            closestHit.r = s.r; closestHit.g=s.g; closestHit.b=s.b;
-            hitSomething = true;
-        }
-    }
+// Intersection kernels over a whole packet, one set per instruction set
+struct PacketKernels {
+    const char *name;
+    void (*sphere)(const RayPacket &packet, const CompiledScene &scene, int prim, int id, PacketHit &hit);
+    void (*triangle)(const RayPacket &packet, const CompiledScene &scene, int prim, int id, PacketHit &hit);
+    int (*box)(const RayPacket &packet, const AABB &box, const PacketHit &hit); // bit i set if lane i enters
+};
 
-    for (const auto& tri: triangles) {
-        float t;
-        if (intersectTriangle(ray,tri,t) && t < closestHit.t) {
-            closestHit.t = t;
-            closestHit.position = ray.origin + ray.direction * t;
-            closestHit.normal = getTriangleNormal(tri);
-            closestHit.r = tri.r; closestHit.g=tri.g; closestHit.b=tri.b;
-            hitSomething = true;
-        }
+// Ray and traversal counters. Each thread counts into its own rayStats, which renderFrame
+// folds into the frame's record after every tile. Counting is on by default and compiled
+// out when NDEBUG is defined (release builds) or with -DRT2_STATS=0, leaving RT2_STAT()
+// statements empty so the hot path pays nothing.
+#ifndef RT2_STATS
+#ifdef NDEBUG
+#define RT2_STATS 0
+#else
+#define RT2_STATS 1
+#endif
+#endif
+
+#if RT2_STATS
+#define RT2_STAT(expr) ((void)(expr))
+#else
+#define RT2_STAT(expr) ((void)0)
+#endif
+
+struct RayStats {
+    uint64_t rays = 0;            // BVH queries, closest-hit and any-hit
+    uint64_t nodesVisited = 0;
+    uint64_t primTests[3] = {};   // indexed by PrimType; instances count each ray taken into one
+    uint64_t shadowRays = 0;
+    uint64_t occluderCacheHits = 0;
+    uint64_t primaryRays = 0;
+    uint64_t reflectionRays = 0;
+    uint64_t hits = 0;            // rays that hit a sphere, triangle or the floor
+    uint64_t reusedPixels = 0;    // pixels taken from the reprojection cache
+    uint64_t supersampledPixels = 0; // pixels given more than their centre sample
+    int maxDepth = 0;             // deepest reflection generation traced
+    uint64_t totalPrimTests() const { return primTests[PRIM_SPHERE] + primTests[PRIM_TRIANGLE]; }
+    RayStats &operator+=(const RayStats &o) {
+        rays += o.rays; nodesVisited += o.nodesVisited;
+        for (int i = 0; i < 3; ++i) primTests[i] += o.primTests[i];
+        shadowRays += o.shadowRays; occluderCacheHits += o.occluderCacheHits;
+        primaryRays += o.primaryRays; reflectionRays += o.reflectionRays;
+        hits += o.hits; maxDepth = std::max(maxDepth, o.maxDepth);
+        reusedPixels += o.reusedPixels; supersampledPixels += o.supersampledPixels;
+        return *this;
     }
+};
+thread_local RayStats rayStats;
 
-    float tPlane;
-    if (intersectPlane(ray, plane, tPlane) && tPlane < closestHit.t) {
-        closestHit.t = tPlane;
-        closestHit.position = ray.origin + ray.direction * tPlane;
-        closestHit.normal = plane.normal;
-        closestHit.r = plane.r; closestHit.g=plane.g; closestHit.b=plane.b;
-        hitSomething = true;
+struct BVH {
+    std::vector<BVHNode> nodes;
+    std::vector<PrimRef> refs;
+    double buildMs = 0.0;
 
-        // Reflection for glaze
-        Vec3 reflectDir = reflect(ray.direction, closestHit.normal).normalize();
-        Ray reflectRay = {closestHit.position + closestHit.normal * 0.001f, reflectDir};
-        Vec3 reflectedColor = trace(reflectRay, spheres, triangles, plane, light, depth+1);
+    void build(const CompiledScene &scene, const std::vector<PrimRef> &prims);
+    void refit(const CompiledScene &scene);
+    bool closest(const Ray &ray, const CompiledScene &scene, float &t, PrimRef &prim, int &instance) const;
+    bool intersect(const Ray &ray, const CompiledScene &scene, HitInfo &hit) const;
+    bool occluded(const Ray &ray, float tMax, const CompiledScene &scene, PrimRef &blocker) const;
+    void intersectPacket(const RayPacket &packet, const PacketKernels &kernels, const CompiledScene &scene, PacketHit &hit) const;
 
-        Vec3 baseColor(plane.r/255.f, plane.g/255.f, plane.b/255.f);
-        return 0.3f * baseColor + 0.7f * reflectedColor;
-    }
+private:
+    std::vector<AABB> primBounds;
+    std::vector<Vec3> centroids;
+    void updateBounds(int nodeIdx);
+    void subdivide(int nodeIdx);
+};
 
-    if (hitSomething) {
-        return shade(closestHit, ray, light, spheres, triangles);
+void BVH::build(const CompiledScene &scene, const std::vector<PrimRef> &prims) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    refs = prims;
+    primBounds.clear(); centroids.clear(); nodes.clear();
+    for (PrimRef ref : refs) primBounds.push_back(refBounds(scene, ref));
+    for (const auto &b : primBounds) centroids.push_back((b.min + b.max) * 0.5f);
+
+    // An empty BVH has no nodes at all; a root with count 0 would read as an inner node
+    if (!refs.empty()) {
+        nodes.reserve(2 * refs.size() + 1);
+        nodes.push_back({AABB(), 0, (int)refs.size()});
+        updateBounds(0);
+        subdivide(0);
     }
 
-    return Vec3(0.1f,0.1f,0.1f); // background
+    auto end = std::chrono::high_resolution_clock::now();
+    buildMs = std::chrono::duration<double, std::milli>(end - start).count();
 }
 
-
-void framebuffer_size_callback(GLFWwindow* window, int width, int height){
-    glViewport(0, 0, width, height);
+// Recomputes every node's bounds for primitives that moved, keeping the tree shape.
+// Children are always stored after their parent, so a reverse sweep is bottom-up.
+void BVH::refit(const CompiledScene &scene) {
+    for (int n = (int)nodes.size() - 1; n >= 0; --n) {
+        BVHNode &node = nodes[n];
+        if (node.count > 0) {
+            node.bounds = AABB();
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) node.bounds.grow(refBounds(scene, refs[i]));
+        } else {
+            node.bounds = nodes[node.leftFirst].bounds;
+            node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+    }
 }
 
-void processInput(GLFWwindow *window){
-    if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window,true);
+void BVH::updateBounds(int nodeIdx) {
+    BVHNode &node = nodes[nodeIdx];
+    node.bounds = AABB();
+    for (int i = 0; i < node.count; ++i) node.bounds.grow(primBounds[node.leftFirst + i]);
 }
 
-int main(){
-    // Initialize GLFW
-    if(!glfwInit()){
-        std::cerr << "Failed to init GLFW\n"; return -1;
-    }
+void BVH::subdivide(int nodeIdx) {
+    const int BINS = 12;
+    BVHNode node = nodes[nodeIdx];
+    if (node.count <= 2) return;
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR,3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR,3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT,GL_TRUE);
-#endif
+    // Bin centroids along each axis and pick the cheapest split
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = node.count * node.bounds.area();
+    float bestMin = 0.f, bestScale = 0.f;
+    for (int axis = 0; axis < 3; ++axis) {
+        float cmin = 1e30f, cmax = -1e30f;
+        for (int i = 0; i < node.count; ++i) {
+            float c = centroids[node.leftFirst + i][axis];
+            cmin = std::min(cmin, c); cmax = std::max(cmax, c);
+        }
+        if (cmax <= cmin) continue;
 
-    GLFWwindow* window=glfwCreateWindow(600,600,"First Hit Ray Tracer",NULL,NULL);
-    if(!window){
-        std::cerr << "Failed to create window\n"; glfwTerminate(); return -1;
-    }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    glfwSetKeyCallback(window, key_callback);
+        AABB binBounds[BINS];
+        int binCount[BINS] = {0};
+        float scale = BINS / (cmax - cmin);
+        for (int i = 0; i < node.count; ++i) {
+            int b = std::min(BINS - 1, int((centroids[node.leftFirst + i][axis] - cmin) * scale));
+            binCount[b]++;
+            binBounds[b].grow(primBounds[node.leftFirst + i]);
+        }
 
-    // Init GLEW
-    glewExperimental=GL_TRUE;
-    if(glewInit() != GLEW_OK){
-        std::cerr << "Failed to init GLEW\n"; glfwTerminate(); return -1;
+        // Sweep from both sides to get the cost of every bin boundary
+        float leftArea[BINS - 1], rightArea[BINS - 1];
+        int leftCount[BINS - 1], rightCount[BINS - 1];
+        AABB lb, rb; int lc = 0, rc = 0;
+        for (int i = 0; i < BINS - 1; ++i) {
+            lc += binCount[i]; lb.grow(binBounds[i]);
+            leftCount[i] = lc; leftArea[i] = lb.area();
+            rc += binCount[BINS - 1 - i]; rb.grow(binBounds[BINS - 1 - i]);
+            rightCount[BINS - 2 - i] = rc; rightArea[BINS - 2 - i] = rb.area();
+        }
+        for (int i = 0; i < BINS - 1; ++i) {
+            float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost) {
+                bestCost = cost; bestAxis = axis; bestSplit = i;
+                bestMin = cmin; bestScale = scale;
+            }
+        }
     }
+    if (bestAxis < 0) return; // splitting is no cheaper than a leaf
 
-    // Compile shaders
-    auto compileShader=[](GLenum type,const char* source){
-        GLuint shader=glCreateShader(type);
-        glShaderSource(shader,1,&source,nullptr);
-        glCompileShader(shader);
-        int success; char infoLog[512];
-        glGetShaderiv(shader,GL_COMPILE_STATUS,&success);
-        if(!success){
-            glGetShaderInfoLog(shader,512,nullptr,infoLog);
-            std::cerr << "Shader failed compilation:\n" << infoLog << "\n";
-        }
-        return shader;
-    };
+    // Partition refs, bounds and centroids together
+    int i = node.leftFirst, j = node.leftFirst + node.count - 1;
+    while (i <= j) {
+        int b = std::min(BINS - 1, int((centroids[i][bestAxis] - bestMin) * bestScale));
+        if (b <= bestSplit) { ++i; continue; }
+        std::swap(refs[i], refs[j]);
+        std::swap(primBounds[i], primBounds[j]);
+        std::swap(centroids[i], centroids[j]);
+        --j;
+    }
+    int leftCount = i - node.leftFirst;
+    if (leftCount == 0 || leftCount == node.count) return;
 
-    GLuint vertShader=compileShader(GL_VERTEX_SHADER,vertexShaderSource);
-    GLuint fragShader=compileShader(GL_FRAGMENT_SHADER,fragmentShaderSource);
+    int leftIdx = (int)nodes.size();
+    nodes.push_back({AABB(), node.leftFirst, leftCount});
+    nodes.push_back({AABB(), i, node.count - leftCount});
+    nodes[nodeIdx].leftFirst = leftIdx;
+    nodes[nodeIdx].count = 0;
+    updateBounds(leftIdx);
+    updateBounds(leftIdx + 1);
+    subdivide(leftIdx);
+    subdivide(leftIdx + 1);
+}
 
-    GLuint program=glCreateProgram();
-    glAttachShader(program,vertShader);
-    glAttachShader(program,fragShader);
-    glLinkProgram(program);
-    int success; char infoLog[512];
-    glGetProgramiv(program,GL_LINK_STATUS,&success);
-    if(!success){
-        glGetProgramInfoLog(program,512,nullptr,infoLog);
-        std::cerr << "Program linking failed:\n" << infoLog << "\n";
-    }
-    glDeleteShader(vertShader);
-    glDeleteShader(fragShader);
+bool intersectInstance(const Ray &ray, const CompiledScene &scene, int k, float &t, int &triangle);
+void intersectInstancePacket(const RayPacket &packet, const PacketKernels &kernels, const CompiledScene &scene, int k, PacketHit &hit);
 
-    float vertices[]={
-        // positions // Texture Coords
-        -1.f,  1.f, 0.f, 1.f,
-        -1.f, -1.f, 0.f, 0.f,
-         1.f, -1.f, 1.f, 0.f,
-        -1.f,  1.f, 0.f, 1.f,
-         1.f, -1.f, 1.f, 0.f,
-         1.f,  1.f, 1.f, 1.f
-    };
+bool BVH::intersect(const Ray &ray, const CompiledScene &scene, HitInfo &hit) const {
+    PrimRef prim;
+    int instance;
+    if (!closest(ray, scene, hit.t, prim, instance)) return false;
+    setHitInfo(ray, prim, scene, hit, instance);
+    return true;
+}
 
-    GLuint VAO,VBO;
-    glGenVertexArrays(1,&VAO);
-    glGenBuffers(1,&VBO);
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER,VBO);
-    glBufferData(GL_ARRAY_BUFFER,sizeof(vertices),vertices,GL_STATIC_DRAW);
-    // Positions
-    glVertexAttribPointer(0,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(void*)0);
-    glEnableVertexAttribArray(0);
-    // TexCoords
-    glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(void*)(2*sizeof(float)));
-    glEnableVertexAttribArray(1);
-    glBindVertexArray(0);
+// Closest primitive nearer than t; t is lowered to its distance. A triangle reached
+// through an instance comes back with the instance's index, otherwise instance is -1.
+bool BVH::closest(const Ray &ray, const CompiledScene &scene, float &tHit, PrimRef &prim, int &instance) const {
+    if (nodes.empty()) return false;
 
-    const int WIDTH=600, HEIGHT=600;
-    std::vector<uint8_t> image(WIDTH*HEIGHT*3);
+    Vec3 invDir(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+    float tRoot;
+    if (!intersectAABB(ray, invDir, nodes[0].bounds, tHit, tRoot)) return false;
 
-    std::vector<Sphere> spheres={
-        {{-0.5f,0.f,0.f},0.4f,0,0,255}, // Blue sphere
-        {{ 0.5f,0.f,0.f},0.3f,0,255,0}  // Green sphere
-    };
-    Vec3 tetraVerts[4] = {
-        {1.5f, 0.5f, 0.f},
-        {1.0f, -0.5f, 0.5f},
-        {2.0f, -0.5f, 0.5f},
-        {1.5f, -0.5f, -0.5f}
-    };
-    std::vector<Triangle> tetrahedron = {
-        {tetraVerts[0], tetraVerts[1], tetraVerts[2], 255,0,255},
-        {tetraVerts[0], tetraVerts[2], tetraVerts[3], 255,0,255},
-        {tetraVerts[0], tetraVerts[3], tetraVerts[1], 255,0,255},
-        {tetraVerts[1], tetraVerts[3], tetraVerts[2], 255,0,255}
-    };
-    Plane floor = {{0,-0.6f,0}, {0,1,0}, 200,200,200}; 
+    // Stack entries remember their entry distance so farther nodes can be culled once a hit is found
+    struct Entry { int node; float tNear; };
+    Entry stack[64]; int sp = 0;
+    stack[sp++] = {0, tRoot};
+    int hitRef = -1, hitTriangle = -1;
+    while (sp > 0) {
+        Entry e = stack[--sp];
+        if (e.tNear >= tHit) continue;
+        const BVHNode &node = nodes[e.node];
+        RT2_STAT(rayStats.nodesVisited++);
 
-    std::vector<Triangle> triangles = tetrahedron;
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                RT2_STAT(rayStats.primTests[refs[i].type]++);
+                float t = tHit;
+                int triangle = -1;
+                bool found = refs[i].type == PRIM_SPHERE ? intersectSphere(ray, scene, refs[i].index, t)
+                           : refs[i].type == PRIM_TRIANGLE ? intersectTriangle(ray, scene, refs[i].index, t)
+                           : intersectInstance(ray, scene, refs[i].index, t, triangle);
+                if (found && t < tHit) { tHit = t; hitRef = i; hitTriangle = triangle; }
+            }
+            continue;
+        }
 
-    float radius = 4.f;
-    float angle = 0.f;
-    float lastTime = glfwGetTime();
-    //int frameNumber = 0;
-    glUseProgram(program);
+        // Push the farther child first so the nearer one is visited next
+        Entry a = {node.leftFirst, 0.f}, b = {node.leftFirst + 1, 0.f};
+        bool hitA = intersectAABB(ray, invDir, nodes[a.node].bounds, tHit, a.tNear);
+        bool hitB = intersectAABB(ray, invDir, nodes[b.node].bounds, tHit, b.tNear);
+        if (hitA && hitB) {
+            if (a.tNear < b.tNear) std::swap(a, b);
+            stack[sp++] = a;
+            stack[sp++] = b;
+        } else if (hitA) {
+            stack[sp++] = a;
+        } else if (hitB) {
+            stack[sp++] = b;
+        }
+    }
+    if (hitRef < 0) return false;
 
-    GLuint texID;
-    glGenTextures(1,&texID);
+    bool viaInstance = refs[hitRef].type == PRIM_INSTANCE;
+    prim = viaInstance ? PrimRef{PRIM_TRIANGLE, hitTriangle} : refs[hitRef];
+    instance = viaInstance ? refs[hitRef].index : -1;
+    return true;
+}
 
-    while(!glfwWindowShouldClose(window)){
-        // Time management for rotation
-        float currentTime = glfwGetTime();
-        float deltaTime = currentTime - lastTime;
-        lastTime = currentTime;
-        angle += deltaTime * 0.5f; // rotation
-
-        // Camera position around Y axis
-        Vec3 camPos = {radius * std::sin(angle), 1.f, radius * std::cos(angle)};
-        Vec3 lookAt = {0.f, 0.f, 0.f};
-        Vec3 camDir = (lookAt - camPos).normalize();
-
-        // Orthonormal basis for camera plane
-        Vec3 worldUp = {0.f,1.f,0.f};
-        Vec3 camRight = camDir.cross(worldUp).normalize();
-        Vec3 camUp = camRight.cross(camDir);
-
-        float fov = 60.0f; // degrees
-        float aspect = float(WIDTH) / float(HEIGHT);
-        float perspectiveScale = tanf((fov * 0.5f) * (M_PI / 180.0f));
-        float orthoScale = 2.0f; // Controls the "zoom" of the orthographic view
-
-        spheres[0].center.y = 0.5f * std::sin(currentTime);
-        spheres[1].center.y = 0.5f * std::sin(currentTime + 3.1415f);
-
-        // Generate rays per pixel
-        for (int y = 0; y < HEIGHT; ++y) {
-            for (int x = 0; x < WIDTH; ++x) {
-                float ndcX = ((x + 0.5f) / WIDTH) * 2.f - 1.f;
-                float ndcY = ((y + 0.5f) / HEIGHT) * 2.f - 1.f;
-
-                Ray ray;
-                if (isPerspective) {
-                    float px = ndcX * aspect * perspectiveScale;
-                    float py = ndcY * perspectiveScale;
-                    Vec3 rayDir = (camRight * px + camUp * py + camDir).normalize();
-                    ray = {camPos, rayDir};
-                } else {
-                    float px = ndcX * aspect * orthoScale;
-                    float py = ndcY * orthoScale;
-                    Vec3 rayOrigin = camPos + camRight * px + camUp * py;
-                    ray = {rayOrigin, camDir}; // Ray direction is always forward
-                }
+// Stops at the first primitive closer than tMax and reports it in blocker
+bool BVH::occluded(const Ray &ray, float tMax, const CompiledScene &scene, PrimRef &blocker) const {
+    if (nodes.empty()) return false;
 
-                Vec3 col = trace(ray, spheres, triangles, floor, light, 0);
+    Vec3 invDir(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+    int stack[64]; int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+        const BVHNode &node = nodes[stack[--sp]];
+        RT2_STAT(rayStats.nodesVisited++);
+        float tBox;
+        if (!intersectAABB(ray, invDir, node.bounds, tMax, tBox)) continue;
 
-                // Clamp and write to image buffer
-                int idx = 3 * (y * WIDTH + x);
-                image[idx]   = std::min(255, int(std::max(0.f, col.x) * 255));
-                image[idx+1] = std::min(255, int(std::max(0.f, col.y) * 255));
-                image[idx+2] = std::min(255, int(std::max(0.f, col.z) * 255));
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                RT2_STAT(rayStats.primTests[refs[i].type]++);
+                if (occludesPrim(ray, scene, refs[i], tMax)) { blocker = refs[i]; return true; }
             }
+            continue;
         }
-        // Update texture
-        glBindTexture(GL_TEXTURE_2D, texID);
-        glTexImage2D(GL_TEXTURE_2D,0,GL_RGB,WIDTH,HEIGHT,0,GL_RGB,GL_UNSIGNED_BYTE,image.data());
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        stack[sp++] = node.leftFirst + 1;
+        stack[sp++] = node.leftFirst;
+    }
+    return false;
+}
 
-        glClearColor(0.2f,0.3f,0.3f,1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
 
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_TRIANGLES,0,6);
-        glBindVertexArray(0);
+void BVH::intersectPacket(const RayPacket &packet, const PacketKernels &kernels, const CompiledScene &scene, PacketHit &hit) const {
+    if (nodes.empty()) return;
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-        processInput(window);
+    // Nodes are kept while any lane still enters them; hit.id is encodePrim() of the primitive.
+    // Visits and tests are counted for the lanes in use that enter the node, the way the
+    // single-ray path counts them. Packets take children in a fixed order, so a lane can
+    // still enter a node that a lone ray, going nearest first, would have culled.
+    int stack[64]; int sp = 0;
+    stack[sp++] = 0;
+#if RT2_STATS
+    const int active = activeLanes(hit);
+#endif
+    while (sp > 0) {
+        const BVHNode &node = nodes[stack[--sp]];
+        int entering = kernels.box(packet, node.bounds, hit);
+        if (!entering) continue;
+#if RT2_STATS
+        const int lanes = laneCount(entering & active);
+#endif
+        RT2_STAT(rayStats.nodesVisited += lanes);
 
-        // Generate render images
-        // char filename[256];
-        // snprintf(filename, sizeof(filename), "frames/frame_%04d.png", frameNumber++);
-        // stbi_write_png(filename, WIDTH, HEIGHT, 3, image.data(), WIDTH * 3);
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                RT2_STAT(rayStats.primTests[refs[i].type] += lanes);
+                if (refs[i].type == PRIM_SPHERE) kernels.sphere(packet, scene, refs[i].index, encodePrim(refs[i]), hit);
+                else if (refs[i].type == PRIM_TRIANGLE) kernels.triangle(packet, scene, refs[i].index, encodePrim(refs[i]), hit);
+                else intersectInstancePacket(packet, kernels, scene, refs[i].index, hit);
+            }
+            continue;
+        }
+        stack[sp++] = node.leftFirst + 1;
+        stack[sp++] = node.leftFirst;
     }
+}
 
-    // Cleanup
-    glDeleteVertexArrays(1,&VAO);
-    glDeleteBuffers(1,&VBO);
-    glDeleteTextures(1,&texID);
-    glDeleteProgram(program);
+// Instances: the ray is taken into the mesh's coordinates and traced through the mesh's
+// BVH. The direction is not renormalised, so distances along it stay those of the world
+// ray and hits compare directly with the rest of the scene.
+Ray toObjectSpace(const Ray &ray, const Transform &toObject) {
+    return {toObject.point(ray.origin), toObject.vector(ray.direction)};
+}
 
-    glfwTerminate();
-    return 0;
+bool intersectInstance(const Ray &ray, const CompiledScene &scene, int k, float &t, int &triangle) {
+    PrimRef prim;
+    int inner;
+    Ray local = toObjectSpace(ray, scene.instances.toObject[k]);
+    if (!scene.meshBVH[scene.instances.mesh[k]].closest(local, scene, t, prim, inner)) return false;
+    triangle = prim.index;
+    return true;
 }
 
+bool occludesInstance(const Ray &ray, const CompiledScene &scene, int k, float tMax) {
+    PrimRef blocker;
+    Ray local = toObjectSpace(ray, scene.instances.toObject[k]);
+    return scene.meshBVH[scene.instances.mesh[k]].occluded(local, tMax, scene, blocker);
+}
+
+void intersectInstancePacket(const RayPacket &packet, const PacketKernels &kernels, const CompiledScene &scene, int k, PacketHit &hit) {
+    const Transform &toObject = scene.instances.toObject[k];
+    RayPacket local;
+    for (int i = 0; i < RayPacket::SIZE; ++i) {
+        Vec3 o = toObject.point(Vec3(packet.ox[i], packet.oy[i], packet.oz[i]));
+        Vec3 d = toObject.vector(Vec3(packet.dx[i], packet.dy[i], packet.dz[i]));
+        local.ox[i] = o.x; local.oy[i] = o.y; local.oz[i] = o.z;
+        local.dx[i] = d.x; local.dy[i] = d.y; local.dz[i] = d.z;
+        local.idx[i] = 1.f / d.x; local.idy[i] = 1.f / d.y; local.idz[i] = 1.f / d.z;
+    }
+    // Lanes the mesh hit closer than anything so far take the triangle and this instance
+    PacketHit localHit = hit;
+    scene.meshBVH[scene.instances.mesh[k]].intersectPacket(local, kernels, scene, localHit);
+    for (int i = 0; i < RayPacket::SIZE; ++i) {
+        if (localHit.t[i] < hit.t[i]) {
+            hit.t[i] = localHit.t[i];
+            hit.id[i] = (localHit.id[i] >> 2) * 4 + INSTANCED_TRIANGLE;
+            hit.instance[i] = k;
+        }
+    }
+}
+
+// Two-level structure: static geometry sits in a BVH built once, moving spheres in a
+// small BVH that is refitted every frame. The top level is just these two roots, so
+// per-frame update cost follows the number of moving objects, not the scene size.
+// Mesh instances are leaves of the static BVH, which leads on into their mesh's BVH.
+struct TwoLevelBVH {
+    BVH staticBVH, dynamicBVH;
+    double buildMs = 0.0;  // full build of both levels, and of the instanced meshes' BVHs
+    double updateMs = 0.0; // last per-frame refit
+
+    void build(const CompiledScene &scene, const std::vector<PrimRef> &staticPrims, const std::vector<PrimRef> &dynamicPrims);
+    void refit(const CompiledScene &scene);
+
+    bool intersect(const Ray &ray, const CompiledScene &scene, HitInfo &hit) const {
+        RT2_STAT(rayStats.rays++);
+        bool hitStatic = staticBVH.intersect(ray, scene, hit);
+        bool hitDynamic = dynamicBVH.intersect(ray, scene, hit); // only overwrites hit when closer
+        return hitStatic || hitDynamic;
+    }
+    bool occluded(const Ray &ray, float tMax, const CompiledScene &scene, PrimRef &blocker) const {
+        RT2_STAT(rayStats.rays++);
+        return dynamicBVH.occluded(ray, tMax, scene, blocker) || staticBVH.occluded(ray, tMax, scene, blocker);
+    }
+    void intersectPacket(const RayPacket &packet, const PacketKernels &kernels, const CompiledScene &scene, PacketHit &hit) const {
+        RT2_STAT(rayStats.rays += laneCount(activeLanes(hit)));
+        staticBVH.intersectPacket(packet, kernels, scene, hit);
+        dynamicBVH.intersectPacket(packet, kernels, scene, hit);
+    }
+};
+
+void TwoLevelBVH::build(const CompiledScene &scene, const std::vector<PrimRef> &staticPrims, const std::vector<PrimRef> &dynamicPrims) {
+    staticBVH.build(scene, staticPrims);
+    dynamicBVH.build(scene, dynamicPrims);
+    buildMs = staticBVH.buildMs + dynamicBVH.buildMs;
+}
+
+void TwoLevelBVH::refit(const CompiledScene &scene) {
+    auto start = std::chrono::high_resolution_clock::now();
+    dynamicBVH.refit(scene);
+    auto end = std::chrono::high_resolution_clock::now();
+    updateMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Packet kernels. Every variant repeats the scalar arithmetic in the same order,
+// so a lane's t is bit-identical to intersectSphere/intersectTriangle on that ray.
+
+void sphereScalar(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    for (int i = 0; i < RayPacket::SIZE; ++i) {
+        Ray ray = {{p.ox[i], p.oy[i], p.oz[i]}, {p.dx[i], p.dy[i], p.dz[i]}};
+        float t;
+        if (intersectSphere(ray, scene, prim, t) && t < hit.t[i]) { hit.t[i] = t; hit.id[i] = id; }
+    }
+}
+
+void triangleScalar(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    for (int i = 0; i < RayPacket::SIZE; ++i) {
+        Ray ray = {{p.ox[i], p.oy[i], p.oz[i]}, {p.dx[i], p.dy[i], p.dz[i]}};
+        float t;
+        if (intersectTriangle(ray, scene, prim, t) && t < hit.t[i]) { hit.t[i] = t; hit.id[i] = id; }
+    }
+}
+
+int boxScalar(const RayPacket &p, const AABB &box, const PacketHit &hit) {
+    int mask = 0;
+    for (int i = 0; i < RayPacket::SIZE; ++i) {
+        Ray ray = {{p.ox[i], p.oy[i], p.oz[i]}, {p.dx[i], p.dy[i], p.dz[i]}};
+        float tNear;
+        if (intersectAABB(ray, Vec3(p.idx[i], p.idy[i], p.idz[i]), box, hit.t[i], tNear)) mask |= 1 << i;
+    }
+    return mask;
+}
+
+const PacketKernels scalarKernels = {"scalar", sphereScalar, triangleScalar, boxScalar};
+
+#ifdef RT2_X86_SIMD
+__attribute__((target("sse2")))
+void sphereSSE(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    const CompiledScene::SphereArrays &sph = scene.spheres;
+    const __m128 signBit = _mm_set1_ps(-0.f);
+    __m128 cx = _mm_set1_ps(sph.cx[prim]), cy = _mm_set1_ps(sph.cy[prim]), cz = _mm_set1_ps(sph.cz[prim]);
+    __m128 rr = _mm_set1_ps(sph.radius2[prim]);
+    __m128 eps = _mm_set1_ps(0.001f);
+    for (int i = 0; i < RayPacket::SIZE; i += 4) {
+        __m128 ocx = _mm_sub_ps(_mm_load_ps(p.ox + i), cx);
+        __m128 ocy = _mm_sub_ps(_mm_load_ps(p.oy + i), cy);
+        __m128 ocz = _mm_sub_ps(_mm_load_ps(p.oz + i), cz);
+        __m128 dx = _mm_load_ps(p.dx + i), dy = _mm_load_ps(p.dy + i), dz = _mm_load_ps(p.dz + i);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 b = _mm_mul_ps(_mm_set1_ps(2.f), d);
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), rr);
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4.f), c));
+        __m128 ok = _mm_cmpge_ps(disc, _mm_setzero_ps());
+        if (!_mm_movemask_ps(ok)) continue;
+        __m128 sq = _mm_sqrt_ps(disc);
+        __m128 nb = _mm_xor_ps(b, signBit);
+        __m128 t0 = _mm_div_ps(_mm_sub_ps(nb, sq), _mm_set1_ps(2.f));
+        __m128 t1 = _mm_div_ps(_mm_add_ps(nb, sq), _mm_set1_ps(2.f));
+        __m128 use0 = _mm_cmpgt_ps(t0, eps);
+        __m128 t = _mm_or_ps(_mm_and_ps(use0, t0), _mm_andnot_ps(use0, t1));
+        __m128 tHit = _mm_load_ps(hit.t + i);
+        ok = _mm_and_ps(ok, _mm_or_ps(use0, _mm_cmpgt_ps(t1, eps)));
+        ok = _mm_and_ps(ok, _mm_cmplt_ps(t, tHit));
+        int mask = _mm_movemask_ps(ok);
+        if (!mask) continue;
+        _mm_store_ps(hit.t + i, _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, tHit)));
+        for (int k = 0; k < 4; ++k) if (mask & (1 << k)) hit.id[i + k] = id;
+    }
+}
+
+__attribute__((target("sse2")))
+void triangleSSE(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    const float EPSILON = 1e-7f;
+    Vec3 c0, c1, c2;
+    scene.triangles.corners(prim, c0, c1, c2);
+    __m128 e1x = _mm_set1_ps(c1.x), e1y = _mm_set1_ps(c1.y), e1z = _mm_set1_ps(c1.z);
+    __m128 e2x = _mm_set1_ps(c2.x), e2y = _mm_set1_ps(c2.y), e2z = _mm_set1_ps(c2.z);
+    __m128 v0x = _mm_set1_ps(c0.x), v0y = _mm_set1_ps(c0.y), v0z = _mm_set1_ps(c0.z);
+    __m128 eps = _mm_set1_ps(EPSILON), one = _mm_set1_ps(1.f), zero = _mm_setzero_ps();
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for (int i = 0; i < RayPacket::SIZE; i += 4) {
+        __m128 dx = _mm_load_ps(p.dx + i), dy = _mm_load_ps(p.dy + i), dz = _mm_load_ps(p.dz + i);
+        __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+        // Reject lanes the same way the scalar code does, so NaNs pass through identically
+        __m128 miss = _mm_cmplt_ps(_mm_and_ps(a, absMask), eps);
+        if (_mm_movemask_ps(miss) == 0xf) continue;
+        __m128 f = _mm_div_ps(one, a);
+        __m128 sx = _mm_sub_ps(_mm_load_ps(p.ox + i), v0x);
+        __m128 sy = _mm_sub_ps(_mm_load_ps(p.oy + i), v0y);
+        __m128 sz = _mm_sub_ps(_mm_load_ps(p.oz + i), v0z);
+        __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+        miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+        miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+        __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+        __m128 tHit = _mm_load_ps(hit.t + i);
+        __m128 ok = _mm_andnot_ps(miss, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, tHit)));
+        int mask = _mm_movemask_ps(ok);
+        if (!mask) continue;
+        _mm_store_ps(hit.t + i, _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, tHit)));
+        for (int k = 0; k < 4; ++k) if (mask & (1 << k)) hit.id[i + k] = id;
+    }
+}
+
+__attribute__((target("sse2")))
+int boxSSE(const RayPacket &p, const AABB &box, const PacketHit &hit) {
+    int mask = 0;
+    for (int i = 0; i < RayPacket::SIZE; i += 4) {
+        __m128 ox = _mm_load_ps(p.ox + i), oy = _mm_load_ps(p.oy + i), oz = _mm_load_ps(p.oz + i);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.x), ox), _mm_load_ps(p.idx + i));
+        __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.x), ox), _mm_load_ps(p.idx + i));
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.y), oy), _mm_load_ps(p.idy + i));
+        __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.y), oy), _mm_load_ps(p.idy + i));
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.z), oz), _mm_load_ps(p.idz + i));
+        __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.z), oz), _mm_load_ps(p.idz + i));
+        __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+        __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+        __m128 enter = _mm_and_ps(_mm_cmpge_ps(tmax, _mm_max_ps(tmin, _mm_setzero_ps())),
+                                  _mm_cmplt_ps(tmin, _mm_load_ps(hit.t + i)));
+        mask |= _mm_movemask_ps(enter) << i;
+    }
+    return mask;
+}
+
+const PacketKernels sseKernels = {"SSE 4-wide", sphereSSE, triangleSSE, boxSSE};
+
+__attribute__((target("avx2")))
+void sphereAVX2(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    const CompiledScene::SphereArrays &sph = scene.spheres;
+    const __m256 signBit = _mm256_set1_ps(-0.f);
+    __m256 ocx = _mm256_sub_ps(_mm256_load_ps(p.ox), _mm256_set1_ps(sph.cx[prim]));
+    __m256 ocy = _mm256_sub_ps(_mm256_load_ps(p.oy), _mm256_set1_ps(sph.cy[prim]));
+    __m256 ocz = _mm256_sub_ps(_mm256_load_ps(p.oz), _mm256_set1_ps(sph.cz[prim]));
+    __m256 dx = _mm256_load_ps(p.dx), dy = _mm256_load_ps(p.dy), dz = _mm256_load_ps(p.dz);
+    __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+    __m256 b = _mm256_mul_ps(_mm256_set1_ps(2.f), d);
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                             _mm256_set1_ps(sph.radius2[prim]));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4.f), c));
+    __m256 ok = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+    if (!_mm256_movemask_ps(ok)) return;
+    __m256 sq = _mm256_sqrt_ps(disc);
+    __m256 nb = _mm256_xor_ps(b, signBit);
+    __m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, sq), _mm256_set1_ps(2.f));
+    __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, sq), _mm256_set1_ps(2.f));
+    __m256 eps = _mm256_set1_ps(0.001f);
+    __m256 use0 = _mm256_cmp_ps(t0, eps, _CMP_GT_OQ);
+    __m256 t = _mm256_blendv_ps(t1, t0, use0);
+    __m256 tHit = _mm256_load_ps(hit.t);
+    ok = _mm256_and_ps(ok, _mm256_or_ps(use0, _mm256_cmp_ps(t1, eps, _CMP_GT_OQ)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, tHit, _CMP_LT_OQ));
+    int mask = _mm256_movemask_ps(ok);
+    if (!mask) return;
+    _mm256_store_ps(hit.t, _mm256_blendv_ps(tHit, t, ok));
+    for (int k = 0; k < 8; ++k) if (mask & (1 << k)) hit.id[k] = id;
+}
+
+__attribute__((target("avx2")))
+void triangleAVX2(const RayPacket &p, const CompiledScene &scene, int prim, int id, PacketHit &hit) {
+    const float EPSILON = 1e-7f;
+    Vec3 c0, c1, c2;
+    scene.triangles.corners(prim, c0, c1, c2);
+    __m256 e1x = _mm256_set1_ps(c1.x), e1y = _mm256_set1_ps(c1.y), e1z = _mm256_set1_ps(c1.z);
+    __m256 e2x = _mm256_set1_ps(c2.x), e2y = _mm256_set1_ps(c2.y), e2z = _mm256_set1_ps(c2.z);
+    __m256 eps = _mm256_set1_ps(EPSILON), one = _mm256_set1_ps(1.f), zero = _mm256_setzero_ps();
+    __m256 dx = _mm256_load_ps(p.dx), dy = _mm256_load_ps(p.dy), dz = _mm256_load_ps(p.dz);
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+    __m256 absA = _mm256_and_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+    __m256 miss = _mm256_cmp_ps(absA, eps, _CMP_LT_OQ);
+    if (_mm256_movemask_ps(miss) == 0xff) return;
+    __m256 f = _mm256_div_ps(one, a);
+    __m256 sx = _mm256_sub_ps(_mm256_load_ps(p.ox), _mm256_set1_ps(c0.x));
+    __m256 sy = _mm256_sub_ps(_mm256_load_ps(p.oy), _mm256_set1_ps(c0.y));
+    __m256 sz = _mm256_sub_ps(_mm256_load_ps(p.oz), _mm256_set1_ps(c0.z));
+    __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+    miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+    miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+                                           _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+    __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+    __m256 tHit = _mm256_load_ps(hit.t);
+    __m256 ok = _mm256_andnot_ps(miss, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GT_OQ), _mm256_cmp_ps(t, tHit, _CMP_LT_OQ)));
+    int mask = _mm256_movemask_ps(ok);
+    if (!mask) return;
+    _mm256_store_ps(hit.t, _mm256_blendv_ps(tHit, t, ok));
+    for (int k = 0; k < 8; ++k) if (mask & (1 << k)) hit.id[k] = id;
+}
+
+__attribute__((target("avx2")))
+int boxAVX2(const RayPacket &p, const AABB &box, const PacketHit &hit) {
+    __m256 ox = _mm256_load_ps(p.ox), oy = _mm256_load_ps(p.oy), oz = _mm256_load_ps(p.oz);
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.x), ox), _mm256_load_ps(p.idx));
+    __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.x), ox), _mm256_load_ps(p.idx));
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.y), oy), _mm256_load_ps(p.idy));
+    __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.y), oy), _mm256_load_ps(p.idy));
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.z), oz), _mm256_load_ps(p.idz));
+    __m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.z), oz), _mm256_load_ps(p.idz));
+    __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), _mm256_min_ps(tz1, tz2));
+    __m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), _mm256_max_ps(tz1, tz2));
+    __m256 enter = _mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_max_ps(tmin, _mm256_setzero_ps()), _CMP_GE_OQ),
+                                 _mm256_cmp_ps(tmin, _mm256_load_ps(hit.t), _CMP_LT_OQ));
+    return _mm256_movemask_ps(enter);
+}
+
+const PacketKernels avx2Kernels = {"AVX2 8-wide", sphereAVX2, triangleAVX2, boxAVX2};
+#endif
+
+// Picks the widest kernels the CPU supports, or the ones named by --simd
+const PacketKernels *selectPacketKernels(const char *request) {
+    bool any = !strcmp(request, "auto");
+#ifdef RT2_X86_SIMD
+    __builtin_cpu_init();
+    if ((any || !strcmp(request, "avx2")) && __builtin_cpu_supports("avx2")) return &avx2Kernels;
+    if ((any || !strcmp(request, "sse")) && __builtin_cpu_supports("sse2")) return &sseKernels;
+#endif
+    if (any || !strcmp(request, "scalar")) return &scalarKernels;
+    return nullptr;
+}
+
+
+// Last primitive that blocked a shadow ray on this thread. Neighbouring shadow rays
+// nearly always hit the same blocker, so it is tested before any traversal. The scene can
+// change between frames (the render service switches scenes on the same threads), so an
+// entry only counts within the frame that cached it: each frame starts a new generation.
+struct OccluderCache {
+    PrimRef prim = {PRIM_SPHERE, -1};
+    unsigned generation = 0;
+};
+thread_local OccluderCache lastOccluder;
+std::atomic<unsigned> occluderGeneration{1};
+
+// Called before a frame's tiles are handed out, which orders it before their shadow rays
+void newOccluderGeneration() { occluderGeneration.fetch_add(1, std::memory_order_relaxed); }
+
+bool occludedLinear(const Ray &ray, float tMax, const CompiledScene &scene, PrimRef &blocker) {
+    for (int i = 0; i < scene.sphereCount(); ++i) {
+        RT2_STAT(rayStats.primTests[PRIM_SPHERE]++);
+        if (occludesSphere(ray, scene, i, tMax)) { blocker = {PRIM_SPHERE, i}; return true; }
+    }
+    for (int m = 0; m < scene.meshCount(); ++m) {
+        if (scene.meshInstanced[m]) continue;
+        for (int i = scene.triangles.meshStart[m]; i < scene.meshEnd(m); ++i) {
+            RT2_STAT(rayStats.primTests[PRIM_TRIANGLE]++);
+            if (occludesTriangle(ray, scene, i, tMax)) { blocker = {PRIM_TRIANGLE, i}; return true; }
+        }
+    }
+    // Instances always go through their mesh's BVH
+    for (int k = 0; k < scene.instanceCount(); ++k) {
+        RT2_STAT(rayStats.primTests[PRIM_INSTANCE]++);
+        if (occludesInstance(ray, scene, k, tMax)) { blocker = {PRIM_INSTANCE, k}; return true; }
+    }
+    return false;
+}
+
+// True if anything lies between the ray origin and tMax
+bool shadowOccluded(const Ray &ray, float tMax, const CompiledScene &scene, const TwoLevelBVH &bvh) {
+    RT2_STAT(rayStats.shadowRays++);
+    unsigned generation = occluderGeneration.load(std::memory_order_relaxed);
+    PrimRef cached = lastOccluder.prim;
+    int count = cached.type == PRIM_SPHERE ? scene.sphereCount() : cached.type == PRIM_TRIANGLE ? scene.triangleCount() : scene.instanceCount();
+    // Triangles of an instanced mesh are in its own coordinates, only its instances may block
+    bool usable = lastOccluder.generation == generation && cached.index >= 0 && cached.index < count &&
+                  !(cached.type == PRIM_TRIANGLE && scene.instanceCount() > 0 && scene.meshInstanced[scene.meshOf(cached.index)]);
+    if (usable && occludesPrim(ray, scene, cached, tMax)) {
+        RT2_STAT(rayStats.occluderCacheHits++);
+        return true;
+    }
+
+    PrimRef blocker;
+    bool blocked = useBVH ? bvh.occluded(ray, tMax, scene, blocker) : occludedLinear(ray, tMax, scene, blocker);
+    if (blocked) lastOccluder = {blocker, generation};
+    return blocked;
+}
+
+Light light = { Vec3(2.f,5.f,5.f), Vec3(1.f,1.f,1.f) };
+
+// Optional parts of the shading model. Render kernels are instantiated for every
+// combination, so a disabled feature costs no branch in the inner loops.
+enum RenderFeature {
+    RENDER_SHADOWS = 1,
+    RENDER_REFLECTIONS = 2, // glazed floor; without it the floor shows its plain colour
+    RENDER_SPECULAR = 4,
+    RENDER_ALL = 7,         // the full shading model, the default
+    RENDER_FAST_MATH = 8,   // approximate shading arithmetic, see checkFastMath()
+    RENDER_FEATURE_BITS = 15
+};
+int renderFeatures = RENDER_ALL;
+
+// Calls fn with std::integral_constant<int, features>, so a generic lambda can pass the
+// runtime feature set on as a template argument
+template <int F = 0, typename Fn>
+auto withFeatures(int features, Fn&& fn) {
+    if constexpr (F == RENDER_FEATURE_BITS) {
+        return fn(std::integral_constant<int, F>());
+    } else {
+        if ((features & RENDER_FEATURE_BITS) == F) return fn(std::integral_constant<int, F>());
+        return withFeatures<F + 1>(features, fn);
+    }
+}
+
+// Fast-math helpers. The hardware reciprocal square root estimate is good to 12 bits;
+// one Newton-Raphson step brings it to about 22, well below what 8-bit output shows.
+inline float rsqrtFast(float x) {
+#if defined(RT2_X86_SIMD) && defined(__SSE__)
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+#else
+    return 1.f / std::sqrt(x);
+#endif
+}
+
+inline Vec3 normalizeFast(const Vec3& v) { return v * rsqrtFast(v.dot(v)); }
+
+// a.normalize().dot(b) without forming the normalised vector
+inline float dotNormalized(const Vec3& a, const Vec3& b) { return a.dot(b) * rsqrtFast(a.dot(a)); }
+
+// x^32, the fixed shininess, by five squarings
+inline float pow32(float x) {
+    x *= x; x *= x; x *= x; x *= x;
+    return x * x;
+}
+
+template <int Features>
+Vec3 normalizeFor(const Vec3& v) { return (Features & RENDER_FAST_MATH) ? normalizeFast(v) : v.normalize(); }
+
+// Ray from a surface point towards the light, and how far it has to go
+template <int Features>
+Ray shadowRayFor(const HitInfo &hit, const Light &light, float &distToLight) {
+    Ray shadowRay;
+    shadowRay.origin = hit.position + hit.normal * 0.001f;
+    Vec3 toLight = light.position - hit.position;
+    if (Features & RENDER_FAST_MATH) {
+        // One estimate gives both the direction and the distance
+        float dist2 = toLight.dot(toLight), inv = rsqrtFast(dist2);
+        shadowRay.direction = toLight * inv;
+        distToLight = dist2 * inv;
+    } else {
+        shadowRay.direction = toLight.normalize();
+        distToLight = toLight.length();
+    }
+    return shadowRay;
+}
+
+// Phong shading once the shadow query for the hit point has been answered
+template <int Features>
+Vec3 shadeLit(const HitInfo &hit, const Ray &ray, const Light &light, bool inShadow) {
+    Vec3 ambientColor(0.1f, 0.1f, 0.1f);
+    Vec3 objectColor(hit.r / 255.f, hit.g / 255.f, hit.b / 255.f);
+
+    if((Features & RENDER_SHADOWS) && inShadow) {
+        return objectColor * ambientColor;
+    }
+
+    Vec3 lightDir = normalizeFor<Features>(light.position - hit.position);
+    float diff = std::max(hit.normal.dot(lightDir), 0.0f);
+    Vec3 diffuse = objectColor * light.color * diff * 0.7f;
+
+    Vec3 color = objectColor * ambientColor + diffuse;
+    if ((Features & RENDER_SPECULAR) && (Features & RENDER_FAST_MATH)) {
+        // Mirroring the unit light direction about the unit normal keeps its length
+        Vec3 reflectDir = 2.0f * hit.normal.dot(lightDir) * hit.normal - lightDir;
+        float spec = pow32(std::max(dotNormalized(ray.origin - hit.position, reflectDir), 0.0f));
+        color = color + light.color * spec * 0.2f;
+    } else if (Features & RENDER_SPECULAR) {
+        Vec3 viewDir = (ray.origin - hit.position).normalize();
+        Vec3 reflectDir = (2.0f * hit.normal.dot(lightDir) * hit.normal - lightDir).normalize();
+        float spec = std::pow(std::max(viewDir.dot(reflectDir), 0.0f), 32);
+        color = color + light.color * spec * 0.2f;
+    }
+    color.x = std::min(color.x, 1.f);
+    color.y = std::min(color.y, 1.f);
+    color.z = std::min(color.z, 1.f);
+
+    return color;
+}
+
+template <int Features>
+Vec3 shade(const HitInfo &hit, const Ray &ray, const Light &light, const CompiledScene &scene, const TwoLevelBVH &bvh) {
+    if (!(Features & RENDER_SHADOWS)) return shadeLit<Features>(hit, ray, light, false);
+    float distToLight;
+    Ray shadowRay = shadowRayFor<Features>(hit, light, distToLight);
+    return shadeLit<Features>(hit, ray, light, shadowOccluded(shadowRay, distToLight, scene, bvh));
+}
+
+// Closest sphere or triangle along one ray; hit.t must start at the far limit
+bool intersectScene(const Ray& ray, const CompiledScene& scene, const TwoLevelBVH& bvh, HitInfo& hit) {
+    if (useBVH) return bvh.intersect(ray, scene, hit);
+
+    // Only t is tracked while scanning; normal and colour are fetched once for the winner
+    RT2_STAT(rayStats.primTests[PRIM_SPHERE] += scene.sphereCount());
+    PrimRef closest = {PRIM_SPHERE, -1};
+    int closestInstance = -1;
+    for (int i = 0; i < scene.sphereCount(); ++i) {
+        float t;
+        if (intersectSphere(ray, scene, i, t) && t < hit.t) {
+            hit.t = t;
+            closest = {PRIM_SPHERE, i};
+        }
+    }
+
+    for (int m = 0; m < scene.meshCount(); ++m) {
+        if (scene.meshInstanced[m]) continue;
+        RT2_STAT(rayStats.primTests[PRIM_TRIANGLE] += scene.meshEnd(m) - scene.triangles.meshStart[m]);
+        for (int i = scene.triangles.meshStart[m]; i < scene.meshEnd(m); ++i) {
+            float t;
+            if (intersectTriangle(ray, scene, i, t) && t < hit.t) {
+                hit.t = t;
+                closest = {PRIM_TRIANGLE, i};
+            }
+        }
+    }
+
+    // Instances always go through their mesh's BVH
+    RT2_STAT(rayStats.primTests[PRIM_INSTANCE] += scene.instanceCount());
+    for (int k = 0; k < scene.instanceCount(); ++k) {
+        int triangle;
+        if (intersectInstance(ray, scene, k, hit.t, triangle)) {
+            closest = {PRIM_TRIANGLE, triangle};
+            closestInstance = k;
+        }
+    }
+
+    if (closest.index < 0) return false;
+    setHitInfo(ray, closest, scene, hit, closestInstance);
+    return true;
+}
+
+// Packet counterpart of intersectScene; hit.id receives encodePrim() of the closest primitive
+void intersectScenePacket(const RayPacket& packet, const PacketKernels& kernels, const CompiledScene& scene, const TwoLevelBVH& bvh, PacketHit& hit) {
+    if (useBVH) {
+        bvh.intersectPacket(packet, kernels, scene, hit);
+        return;
+    }
+#if RT2_STATS
+    const int lanes = laneCount(activeLanes(hit));
+#endif
+    RT2_STAT(rayStats.primTests[PRIM_SPHERE] += uint64_t(lanes) * scene.sphereCount());
+    RT2_STAT(rayStats.primTests[PRIM_INSTANCE] += uint64_t(lanes) * scene.instanceCount());
+    for (int i = 0; i < scene.sphereCount(); ++i) kernels.sphere(packet, scene, i, encodePrim({PRIM_SPHERE, i}), hit);
+    for (int m = 0; m < scene.meshCount(); ++m) {
+        if (scene.meshInstanced[m]) continue;
+        RT2_STAT(rayStats.primTests[PRIM_TRIANGLE] += uint64_t(lanes) * (scene.meshEnd(m) - scene.triangles.meshStart[m]));
+        for (int i = scene.triangles.meshStart[m]; i < scene.meshEnd(m); ++i) kernels.triangle(packet, scene, i, encodePrim({PRIM_TRIANGLE, i}), hit);
+    }
+    for (int k = 0; k < scene.instanceCount(); ++k) intersectInstancePacket(packet, kernels, scene, k, hit);
+}
+
+template <int Features>
+Vec3 finishTrace(const Ray& ray, HitInfo closestHit, bool hitSomething, const CompiledScene& scene, const TwoLevelBVH& bvh, const Plane& plane, const Light& light, int depth);
+
+template <int Features>
+Vec3 trace(const Ray& ray, const CompiledScene& scene, const TwoLevelBVH& bvh, const Plane& plane, const Light& light, int depth = 0)
+{
+    if (depth > 2) return Vec3(0.1f,0.1f,0.1f); // recursion limit
+    RT2_STAT(rayStats.maxDepth = std::max(rayStats.maxDepth, depth));
+
+    HitInfo closestHit; 
+    closestHit.t = 1e20f; 
+    bool hitSomething = intersectScene(ray, scene, bvh, closestHit);
+
+    return finishTrace<Features>(ray, closestHit, hitSomething, scene, bvh, plane, light, depth);
+}
+
+// Everything after the closest sphere or triangle is known: the floor, its reflection and shading
+template <int Features>
+Vec3 finishTrace(const Ray& ray, HitInfo closestHit, bool hitSomething, const CompiledScene& scene, const TwoLevelBVH& bvh, const Plane& plane, const Light& light, int depth)
+{
+    float tPlane;
+    if (intersectPlane(ray, plane, tPlane) && tPlane < closestHit.t) {
+        RT2_STAT(rayStats.hits++);
+        Vec3 baseColor(plane.r/255.f, plane.g/255.f, plane.b/255.f);
+        if (!(Features & RENDER_REFLECTIONS)) return baseColor;
+
+        closestHit.t = tPlane;
+        closestHit.position = ray.origin + ray.direction * tPlane;
+        closestHit.normal = plane.normal;
+        closestHit.r = plane.r; closestHit.g=plane.g; closestHit.b=plane.b;
+        hitSomething = true;
+
+        // Reflection for glaze
+        Vec3 reflectDir = normalizeFor<Features>(reflect(ray.direction, closestHit.normal));
+        Ray reflectRay = {closestHit.position + closestHit.normal * 0.001f, reflectDir};
+        RT2_STAT(rayStats.reflectionRays++);
+        Vec3 reflectedColor = trace<Features>(reflectRay, scene, bvh, plane, light, depth+1);
+
+        return 0.3f * baseColor + 0.7f * reflectedColor;
+    }
+
+    if (hitSomething) {
+        RT2_STAT(rayStats.hits++);
+        return shade<Features>(closestHit, ray, light, scene, bvh);
+    }
+
+    return Vec3(0.1f,0.1f,0.1f); // background
+}
+
+// Entry points for callers outside the specialised kernels; they pick the instance once per ray
+Vec3 trace(const Ray& ray, const CompiledScene& scene, const TwoLevelBVH& bvh, const Plane& plane, const Light& light) {
+    return withFeatures(renderFeatures, [&](auto f) { return trace<decltype(f)::value>(ray, scene, bvh, plane, light, 0); });
+}
+
+Vec3 finishTrace(const Ray& ray, const HitInfo& closestHit, bool hitSomething, const CompiledScene& scene, const TwoLevelBVH& bvh, const Plane& plane, const Light& light) {
+    return withFeatures(renderFeatures, [&](auto f) {
+        return finishTrace<decltype(f)::value>(ray, closestHit, hitSomething, scene, bvh, plane, light, 0);
+    });
+}
+
+
+// Work-stealing pool for the per-pixel loop. Each worker owns a deque of tiles,
+// takes work from its front and steals from the back of the others once it runs dry.
+// The calling thread takes part as worker 0, so one thread means no extra threads.
+class TileScheduler {
+public:
+    explicit TileScheduler(int threadCount);
+    ~TileScheduler();
+    // Runs fn(task) for every task in [0, taskCount) and returns once all are done
+    void run(int taskCount, const std::function<void(int)> &fn);
+    int threadCount() const { return (int)queues.size(); }
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<int> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex m;
+    std::condition_variable startCv, doneCv;
+    const std::function<void(int)> *job = nullptr;
+    uint64_t generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+    bool next(int self, int &task);
+    void work(int self);
+    void workerLoop(int self);
+};
+
+TileScheduler::TileScheduler(int threadCount) {
+    threadCount = std::max(1, threadCount);
+    for (int i = 0; i < threadCount; ++i) queues.push_back(std::make_unique<Queue>());
+    for (int i = 1; i < threadCount; ++i) threads.emplace_back(&TileScheduler::workerLoop, this, i);
+}
+
+TileScheduler::~TileScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    startCv.notify_all();
+    for (auto &t : threads) t.join();
+}
+
+void TileScheduler::run(int taskCount, const std::function<void(int)> &fn) {
+    // Hand out contiguous runs of tiles so each worker starts on a coherent screen region
+    int n = threadCount();
+    for (int w = 0; w < n; ++w) {
+        std::lock_guard<std::mutex> lock(queues[w]->m);
+        for (int i = taskCount * w / n; i < taskCount * (w + 1) / n; ++i) queues[w]->tasks.push_back(i);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m);
+        job = &fn;
+        busyWorkers = n - 1;
+        generation++;
+    }
+    startCv.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(m);
+    doneCv.wait(lock, [this] { return busyWorkers == 0; });
+    job = nullptr;
+}
+
+bool TileScheduler::next(int self, int &task) {
+    {
+        Queue &own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.m);
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    int n = threadCount();
+    for (int i = 1; i < n; ++i) {
+        Queue &victim = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> lock(victim.m);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TileScheduler::work(int self) {
+    int task;
+    while (next(self, task)) (*job)(task);
+}
+
+void TileScheduler::workerLoop(int self) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            startCv.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        work(self);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            busyWorkers--;
+        }
+        doneCv.notify_one();
+    }
+}
+
+
+// The animated scene: two bobbing spheres, a tetrahedron and the glazed floor
+struct World {
+    std::vector<Sphere> spheres;
+    std::vector<Mesh> meshes;        // buildAccel moves their vertices and indices into scene
+    std::vector<Instance> instances; // a mesh that has instances is drawn only through them
+    Plane floor;
+    std::vector<int> movingSpheres; // animated each frame, kept in the dynamic BVH
+    CompiledScene scene;
+    TwoLevelBVH bvh;
+};
+
+// Compiles the whole scene and builds both BVH levels. Needed again only when
+// primitives are added or removed, or the set of moving spheres changes; the meshes'
+// triangles then have to be given again, as compiling hands them to the scene.
+void buildAccel(World& world) {
+    CompiledScene& scene = world.scene;
+    scene.compile(world.spheres, world.meshes, world.instances);
+    std::vector<PrimRef> staticPrims, dynamicPrims;
+    for (int i = 0; i < (int)world.spheres.size(); ++i) {
+        bool moving = std::find(world.movingSpheres.begin(), world.movingSpheres.end(), i) != world.movingSpheres.end();
+        (moving ? dynamicPrims : staticPrims).push_back({PRIM_SPHERE, i});
+    }
+
+    // Meshes with instances get a BVH of their own, in their own coordinates; the rest
+    // go into the static BVH triangle by triangle
+    scene.meshBVH.assign(scene.meshCount(), BVH());
+    for (int m = 0; m < scene.meshCount(); ++m) {
+        std::vector<PrimRef> meshPrims;
+        for (int i = scene.triangles.meshStart[m]; i < scene.meshEnd(m); ++i) meshPrims.push_back({PRIM_TRIANGLE, i});
+        if (scene.meshInstanced[m]) scene.meshBVH[m].build(scene, meshPrims);
+        else staticPrims.insert(staticPrims.end(), meshPrims.begin(), meshPrims.end());
+    }
+    for (int k = 0; k < scene.instanceCount(); ++k) {
+        const BVH& mesh = scene.meshBVH[scene.instances.mesh[k]];
+        if (mesh.nodes.empty()) continue;
+        // World bounds: the corners of the mesh's box carried over by the instance transform
+        const AABB& local = mesh.nodes[0].bounds;
+        AABB& bounds = scene.instances.bounds[k];
+        for (int c = 0; c < 8; ++c) {
+            Vec3 corner(c & 1 ? local.max.x : local.min.x, c & 2 ? local.max.y : local.min.y, c & 4 ? local.max.z : local.min.z);
+            bounds.grow(world.instances[k].transform.point(corner));
+        }
+        staticPrims.push_back({PRIM_INSTANCE, k});
+    }
+    world.bvh.build(scene, staticPrims, dynamicPrims);
+    for (const BVH& mesh : scene.meshBVH) world.bvh.buildMs += mesh.buildMs;
+}
+
+World makeWorld() {
+    World world;
+    world.spheres={
+        {{-0.5f,0.f,0.f},0.4f,0,0,255}, // Blue sphere
+        {{ 0.5f,0.f,0.f},0.3f,0,255,0}  // Green sphere
+    };
+    Mesh tetrahedron = {
+        {{1.5f, 0.5f, 0.f}, {1.0f, -0.5f, 0.5f}, {2.0f, -0.5f, 0.5f}, {1.5f, -0.5f, -0.5f}},
+        {0,1,2, 0,2,3, 0,3,1, 1,3,2},
+        255,0,255
+    };
+    world.floor = {{0,-0.6f,0}, {0,1,0}, 200,200,200};
+
+    world.meshes = {tetrahedron};
+    world.movingSpheres = {0, 1};
+    buildAccel(world);
+    return world;
+}
+
+// Fixed-seed generator for the benchmark scenes. minstd_rand is fully specified by the
+// standard, so every platform builds the same scenes.
+struct SceneRng {
+    std::minstd_rand engine;
+    explicit SceneRng(unsigned seed) : engine(seed) {}
+    float next(float lo, float hi) {
+        return lo + (hi - lo) * float(engine() - engine.min()) / float(engine.max() - engine.min());
+    }
+    uint8_t channel() { return uint8_t(next(40.f, 255.f)); }
+};
+
+// 10k small spheres scattered over the floor, all static
+World makeSphereFieldWorld() {
+    World world;
+    SceneRng rng(1);
+    for (int i = 0; i < 10000; ++i) {
+        Vec3 center(rng.next(-2.f, 2.f), rng.next(-0.5f, 1.f), rng.next(-2.f, 2.f));
+        float radius = rng.next(0.02f, 0.06f);
+        world.spheres.push_back({center, radius, rng.channel(), rng.channel(), rng.channel()});
+    }
+    world.floor = {{0,-0.6f,0}, {0,1,0}, 200,200,200};
+    buildAccel(world);
+    return world;
+}
+
+// Torus of rings x sides quads lying in the xz plane, with a bumpy surface
+Mesh makeTorus(SceneRng& rng, int rings, int sides, float major, float minor) {
+    Mesh torus;
+    std::vector<Vec3> &verts = torus.vertices;
+    verts.resize(size_t(rings) * sides);
+    for (int i = 0; i < rings; ++i) {
+        float u = 2.f * float(M_PI) * i / rings;
+        for (int j = 0; j < sides; ++j) {
+            float v = 2.f * float(M_PI) * j / sides;
+            float rr = minor * rng.next(0.97f, 1.03f);
+            float ring = major + rr * std::cos(v);
+            verts[size_t(i) * sides + j] = {ring * std::cos(u), rr * std::sin(v), ring * std::sin(u)};
+        }
+    }
+    torus.indices.reserve(size_t(rings) * sides * 6);
+    for (int i = 0; i < rings; ++i) {
+        for (int j = 0; j < sides; ++j) {
+            uint32_t a = i * sides + j, b = (i + 1) % rings * sides + j;
+            uint32_t c = (i + 1) % rings * sides + (j + 1) % sides, d = i * sides + (j + 1) % sides;
+            torus.indices.insert(torus.indices.end(), {a, b, c, a, c, d});
+        }
+    }
+    torus.r = 220; torus.g = 160; torus.b = 60;
+    return torus;
+}
+
+// Torus of 1000 x 500 quads (1M triangles) with a fixed-seed bumpy surface
+World makeMeshWorld() {
+    World world;
+    SceneRng rng(2);
+    world.meshes = {makeTorus(rng, 1000, 500, 1.2f, 0.4f)};
+    world.floor = {{0,-0.6f,0}, {0,1,0}, 200,200,200};
+    buildAccel(world);
+    return world;
+}
+
+// 24 x 24 instances of one 40k-triangle torus lying on the floor, each turned and scaled
+// at random: 23M triangles on screen, 40k in memory
+World makeInstanceWorld() {
+    World world;
+    SceneRng rng(4);
+    world.meshes = {makeTorus(rng, 200, 100, 1.f, 0.35f)};
+    world.floor = {{0,-0.6f,0}, {0,1,0}, 200,200,200};
+    const int grid = 24;
+    for (int i = 0; i < grid; ++i) {
+        for (int j = 0; j < grid; ++j) {
+            float scale = rng.next(0.04f, 0.06f);
+            Vec3 position(-2.f + 4.f * (i + 0.5f) / grid, world.floor.point.y + 0.35f * scale, -2.f + 4.f * (j + 0.5f) / grid);
+            world.instances.push_back({0, Transform::place(position, rng.next(0.f, 2.f * float(M_PI)), scale)});
+        }
+    }
+    buildAccel(world);
+    return world;
+}
+
+// Floor raised to the camera's look-at height, so the lower half of every frame is glaze
+// and sends a reflection ray into a grid of spheres
+World makeReflectionWorld() {
+    World world;
+    SceneRng rng(3);
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            float radius = rng.next(0.1f, 0.2f);
+            Vec3 center(-1.75f + 0.5f * i, radius + rng.next(0.f, 0.3f), -1.75f + 0.5f * j);
+            world.spheres.push_back({center, radius, rng.channel(), rng.channel(), rng.channel()});
+        }
+    }
+    world.floor = {{0,0.f,0}, {0,1,0}, 200,200,200};
+    buildAccel(world);
+    return world;
+}
+
+// Builds a scene by name; false if there is no such scene
+bool makeNamedWorld(const std::string& name, World& world) {
+    if (name == "default") world = makeWorld();
+    else if (name == "spheres10k") world = makeSphereFieldWorld();
+    else if (name == "mesh1m") world = makeMeshWorld();
+    else if (name == "reflections") world = makeReflectionWorld();
+    else if (name == "instances") world = makeInstanceWorld();
+    else return false;
+    return true;
+}
+
+// One piece of an OBJ file, parsed on its own. Positive indices are final once made zero
+// based; negative ones count back from the vertices read so far, which depends on the
+// chunks before, so they are kept as (corner, local index) until those are known.
+struct ObjChunk {
+    std::vector<Vec3> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<std::pair<size_t, int64_t>> relative;
+    std::string error;
+};
+
+void parseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+    struct Corner { int64_t index; bool relative; };
+    std::vector<Corner> polygon;
+    while (p < end && chunk.error.empty()) {
+        const char* lineEnd = std::find(p, end, '\n');
+        const char* line = p;
+        p = lineEnd + (lineEnd < end);
+        auto skipSpace = [&] { while (line < lineEnd && (*line == ' ' || *line == '\t' || *line == '\r')) ++line; };
+        skipSpace();
+        const char* lineStart = line;
+        if (lineEnd - line < 2 || (line[1] != ' ' && line[1] != '\t')) continue; // vt, vn, comments, groups...
+        if (line[0] == 'v') {
+            float xyz[3];
+            ++line;
+            for (float& c : xyz) {
+                skipSpace();
+                if (line < lineEnd && *line == '+') ++line;
+                std::from_chars_result r = std::from_chars(line, lineEnd, c);
+                if (r.ec != std::errc()) {
+                    chunk.error = "bad vertex \"" + std::string(lineStart, lineEnd) + "\""; break;
+                }
+                line = r.ptr;
+            }
+            chunk.vertices.push_back({xyz[0], xyz[1], xyz[2]});
+        } else if (line[0] == 'f') {
+            // Corners are "v", "v/vt", "v//vn" or "v/vt/vn"; only v is used
+            polygon.clear();
+            ++line;
+            for (skipSpace(); line < lineEnd; skipSpace()) {
+                int64_t index = 0;
+                std::from_chars_result r = std::from_chars(line, lineEnd, index);
+                if (r.ec != std::errc() || index == 0) {
+                    chunk.error = "bad face \"" + std::string(lineStart, lineEnd) + "\""; break;
+                }
+                if (index > 0) polygon.push_back({index - 1, false});
+                else polygon.push_back({int64_t(chunk.vertices.size()) + index, true});
+                line = r.ptr;
+                while (line < lineEnd && *line != ' ' && *line != '\t' && *line != '\r') ++line;
+            }
+            // Polygons become fans around their first corner
+            for (size_t k = 2; k < polygon.size() && chunk.error.empty(); ++k) {
+                for (const Corner& corner : {polygon[0], polygon[k - 1], polygon[k]}) {
+                    if (corner.relative) chunk.relative.push_back({chunk.indices.size(), corner.index});
+                    chunk.indices.push_back(corner.relative ? 0 : uint32_t(std::min<int64_t>(corner.index, UINT32_MAX)));
+                }
+            }
+        }
+    }
+}
+
+// Reads the vertices and faces of a Wavefront OBJ file into one mesh; texture coordinates,
+// normals, groups and materials are skipped. The file is read whole and cut at line breaks
+// into a few chunks per worker, which are parsed at the same time on the tile scheduler
+// and then joined in file order.
+bool loadOBJ(const std::string& path, TileScheduler& scheduler, Mesh& mesh, std::string& error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "cannot open " + path; return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // At least 1 MB per chunk, so small files do not pay for the split
+    const size_t MIN_CHUNK = size_t(1) << 20;
+    int chunkCount = (int)std::max<size_t>(1, std::min<size_t>(size_t(scheduler.threadCount()) * 4, text.size() / MIN_CHUNK));
+    std::vector<size_t> starts(chunkCount + 1, text.size());
+    for (int c = 0; c < chunkCount; ++c) {
+        size_t start = text.size() / chunkCount * c;
+        if (c > 0) {
+            start = text.find('\n', start);
+            start = start == std::string::npos ? text.size() : start + 1;
+        }
+        starts[c] = std::max(start, c > 0 ? starts[c - 1] : 0);
+    }
+    std::vector<ObjChunk> chunks(chunkCount);
+    scheduler.run(chunkCount, [&](int c) {
+        parseObjChunk(text.data() + starts[c], text.data() + starts[c + 1], chunks[c]);
+    });
+
+    size_t vertexCount = 0, indexCount = 0;
+    std::vector<size_t> vertexStart(chunkCount), indexStart(chunkCount);
+    for (int c = 0; c < chunkCount; ++c) {
+        if (!chunks[c].error.empty()) {
+            error = path + ": " + chunks[c].error; return false;
+        }
+        vertexStart[c] = vertexCount; indexStart[c] = indexCount;
+        vertexCount += chunks[c].vertices.size();
+        indexCount += chunks[c].indices.size();
+    }
+    if (vertexCount > UINT32_MAX) {
+        error = path + ": more vertices than 32-bit indices can address"; return false;
+    }
+    if (indexCount == 0) {
+        error = path + ": no faces"; return false;
+    }
+
+    mesh.vertices.resize(vertexCount);
+    mesh.indices.resize(indexCount);
+    std::atomic<bool> outOfRange{false};
+    scheduler.run(chunkCount, [&](int c) {
+        ObjChunk& chunk = chunks[c];
+        for (const auto& corner : chunk.relative) {
+            int64_t index = int64_t(vertexStart[c]) + corner.second;
+            chunk.indices[corner.first] = index < 0 ? UINT32_MAX : uint32_t(index);
+        }
+        for (uint32_t index : chunk.indices) if (index >= vertexCount) outOfRange = true;
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.begin() + vertexStart[c]);
+        std::copy(chunk.indices.begin(), chunk.indices.end(), mesh.indices.begin() + indexStart[c]);
+        chunk = ObjChunk();
+    });
+    if (outOfRange) {
+        error = path + ": a face refers to a vertex the file does not have"; return false;
+    }
+    return true;
+}
+
+// Scales a mesh uniformly so its largest side is size, and moves it so its bounding box is
+// centred on base in x and z and rests on base in y
+void placeMesh(Mesh& mesh, const Vec3& base, float size) {
+    AABB box;
+    for (const Vec3& v : mesh.vertices) box.grow(v);
+    Vec3 extent = box.max - box.min;
+    float scale = size / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-20f));
+    Vec3 anchor((box.min.x + box.max.x) * 0.5f, box.min.y, (box.min.z + box.max.z) * 0.5f);
+    for (Vec3& v : mesh.vertices) v = base + (v - anchor) * scale;
+}
+
+// Moves the spheres to their positions at the given time. Only the moving spheres are
+// recompiled and only the dynamic BVH is refitted.
+void animateWorld(World& world, float time) {
+    for (size_t k = 0; k < world.movingSpheres.size(); ++k)
+        world.spheres[world.movingSpheres[k]].center.y = 0.5f * std::sin(time + k * 3.1415f);
+
+    for (int i : world.movingSpheres) world.scene.updateSphere(i, world.spheres[i]);
+    world.bvh.refit(world.scene);
+}
+
+struct Camera {
+    Vec3 pos, dir, right, up;
+    bool perspective;
+    float aspect, perspectiveScale, orthoScale;
+};
+
+// Camera circling the origin at the given angle around the Y axis
+Camera orbitCamera(float angle, float aspect, bool perspective) {
+    float radius = 4.f;
+    Camera cam;
+    cam.pos = {radius * std::sin(angle), 1.f, radius * std::cos(angle)};
+    Vec3 lookAt = {0.f, 0.f, 0.f};
+    cam.dir = (lookAt - cam.pos).normalize();
+
+    // Orthonormal basis for camera plane
+    Vec3 worldUp = {0.f,1.f,0.f};
+    cam.right = cam.dir.cross(worldUp).normalize();
+    cam.up = cam.right.cross(cam.dir);
+
+    float fov = 60.0f; // degrees
+    cam.perspective = perspective;
+    cam.aspect = aspect;
+    cam.perspectiveScale = tanf((fov * 0.5f) * (M_PI / 180.0f));
+    cam.orthoScale = 2.0f; // Controls the "zoom" of the orthographic view
+    return cam;
+}
+
+// Ray through the image position (sx, sy) in pixels; pixel x covers [x, x + 1).
+// The projection is a template argument so per-pixel loops do not test it for every ray.
+template <bool Perspective>
+Ray cameraRay(const Camera& cam, float sx, float sy, int width, int height) {
+    float ndcX = (sx / width) * 2.f - 1.f;
+    float ndcY = (sy / height) * 2.f - 1.f;
+
+    Ray ray;
+    if (Perspective) {
+        float px = ndcX * cam.aspect * cam.perspectiveScale;
+        float py = ndcY * cam.perspectiveScale;
+        Vec3 rayDir = (cam.right * px + cam.up * py + cam.dir).normalize();
+        ray = {cam.pos, rayDir};
+    } else {
+        float px = ndcX * cam.aspect * cam.orthoScale;
+        float py = ndcY * cam.orthoScale;
+        Vec3 rayOrigin = cam.pos + cam.right * px + cam.up * py;
+        ray = {rayOrigin, cam.dir}; // Ray direction is always forward
+    }
+    return ray;
+}
+
+Ray primaryRayAt(const Camera& cam, float sx, float sy, int width, int height) {
+    return cam.perspective ? cameraRay<true>(cam, sx, sy, width, height) : cameraRay<false>(cam, sx, sy, width, height);
+}
+
+Ray primaryRay(const Camera& cam, int x, int y, int width, int height) {
+    return primaryRayAt(cam, x + 0.5f, y + 0.5f, width, height);
+}
+
+// What the reprojection cache keeps per pixel: the first thing the pixel's ray met
+struct CachedPixel {
+    enum State : uint8_t { EMPTY, BACKGROUND, SURFACE, FLOOR };
+    Vec3 position, normal;  // first surface hit
+    Vec3 viewDir;           // primary ray direction when traced
+    Vec3 color;
+    State state = EMPTY;
+    uint8_t age = 0;        // frames since traced
+};
+
+void recordFirstHit(const Ray& ray, const HitInfo& hit, bool hitSomething, const Plane& plane, CachedPixel& out) {
+    float tPlane;
+    if (intersectPlane(ray, plane, tPlane) && tPlane < hit.t) {
+        out.state = CachedPixel::FLOOR;
+        out.position = ray.origin + ray.direction * tPlane;
+        out.normal = plane.normal;
+    } else if (hitSomething) {
+        out.state = CachedPixel::SURFACE;
+        out.position = hit.position;
+        out.normal = hit.normal;
+    } else {
+        out.state = CachedPixel::BACKGROUND;
+        out.position = ray.origin;
+        out.normal = Vec3();
+    }
+    out.viewDir = ray.direction;
+    out.age = 0;
+}
+
+// Wavefront tracing: the rays of one tile move through the stages together instead of
+// each pixel recursing on its own. Every stage is a flat loop over contiguous arrays, and
+// a floor reflection becomes an entry in the next generation's queue rather than a call.
+struct RayQueue {
+    FloatArray ox, oy, oz, dx, dy, dz;
+    std::vector<int> pixel; // index within the tile
+
+    int size() const { return (int)pixel.size(); }
+    void clear() {
+        ox.clear(); oy.clear(); oz.clear(); dx.clear(); dy.clear(); dz.clear();
+        pixel.clear();
+    }
+    void push(const Ray& ray, int p) {
+        ox.push_back(ray.origin.x); oy.push_back(ray.origin.y); oz.push_back(ray.origin.z);
+        dx.push_back(ray.direction.x); dy.push_back(ray.direction.y); dz.push_back(ray.direction.z);
+        pixel.push_back(p);
+    }
+    Ray ray(int i) const { return {Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i])}; }
+};
+
+// Per-thread queues, reused from tile to tile so the stages never allocate once warm
+struct WavefrontBuffers {
+    RayQueue rays, nextRays;           // current generation and the reflections it spawns
+    std::vector<HitInfo> hits;         // closest sphere or triangle per ray
+    std::vector<uint8_t> hitPrim;
+    std::vector<int> shadeList;        // rays whose closest hit is a sphere or triangle
+    RayQueue shadowRays;               // one per shadeList entry, pixel holds the ray index
+    FloatArray shadowDist;
+    std::vector<uint8_t> inShadow;
+    std::vector<Vec3> color;           // per pixel: colour at the end of its reflection chain
+    std::vector<uint8_t> bounces;      // per pixel: floor reflections on the way there
+    std::vector<CachedPixel> first;    // per pixel: first surface, when recording for the cache
+};
+
+thread_local WavefrontBuffers wavefront;
+
+template <bool Perspective>
+void wavefrontGenerate(WavefrontBuffers& wf, const Camera& cam, int x0, int y0, int x1, int y1, int width, int height) {
+    wf.rays.clear();
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x) wf.rays.push(cameraRay<Perspective>(cam, x + 0.5f, y + 0.5f, width, height), (y - y0) * (x1 - x0) + (x - x0));
+}
+
+void wavefrontGenerate(WavefrontBuffers& wf, const Camera& cam, int x0, int y0, int x1, int y1, int width, int height) {
+    if (cam.perspective) wavefrontGenerate<true>(wf, cam, x0, y0, x1, y1, width, height);
+    else wavefrontGenerate<false>(wf, cam, x0, y0, x1, y1, width, height);
+}
+
+void wavefrontClosestHit(WavefrontBuffers& wf, const PacketKernels* kernels, const CompiledScene& scene, const TwoLevelBVH& bvh) {
+    const RayQueue& rays = wf.rays;
+    int n = rays.size();
+    wf.hits.resize(n);
+    wf.hitPrim.resize(n);
+    if (!kernels) {
+        for (int i = 0; i < n; ++i) {
+            wf.hits[i].t = 1e20f;
+            wf.hitPrim[i] = intersectScene(rays.ray(i), scene, bvh, wf.hits[i]);
+        }
+        return;
+    }
+
+    // Consecutive queue entries form the packets, whatever generation they belong to
+    for (int s = 0; s < n; s += RayPacket::SIZE) {
+        int m = std::min(RayPacket::SIZE, n - s);
+        RayPacket packet;
+        PacketHit hits;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            int j = s + std::min(i, m - 1);
+            packet.ox[i] = rays.ox[j]; packet.oy[i] = rays.oy[j]; packet.oz[i] = rays.oz[j];
+            packet.dx[i] = rays.dx[j]; packet.dy[i] = rays.dy[j]; packet.dz[i] = rays.dz[j];
+            packet.idx[i] = 1.f / packet.dx[i]; packet.idy[i] = 1.f / packet.dy[i]; packet.idz[i] = 1.f / packet.dz[i];
+            hits.t[i] = i < m ? 1e20f : 0.f;
+            hits.id[i] = -1;
+        }
+        intersectScenePacket(packet, *kernels, scene, bvh, hits);
+        for (int i = 0; i < m; ++i) {
+            wf.hits[s + i].t = hits.t[i];
+            wf.hitPrim[s + i] = hits.id[i] >= 0;
+            if (wf.hitPrim[s + i]) setHitInfo(rays.ray(s + i), hits, i, scene, wf.hits[s + i]);
+        }
+    }
+}
+
+// Floor test: rays landing on the glazed floor spawn the next generation, the rest are
+// queued for shading or see the background
+template <int Features>
+void wavefrontReflect(WavefrontBuffers& wf, const Plane& plane) {
+    const RayQueue& rays = wf.rays;
+    wf.nextRays.clear();
+    wf.shadeList.clear();
+    for (int i = 0; i < rays.size(); ++i) {
+        Ray ray = rays.ray(i);
+        int p = rays.pixel[i];
+        float tPlane;
+        if (intersectPlane(ray, plane, tPlane) && tPlane < wf.hits[i].t) {
+            RT2_STAT(rayStats.hits++);
+            if (!(Features & RENDER_REFLECTIONS)) {
+                wf.color[p] = Vec3(plane.r/255.f, plane.g/255.f, plane.b/255.f);
+                continue;
+            }
+            Vec3 position = ray.origin + ray.direction * tPlane;
+            Vec3 reflectDir = normalizeFor<Features>(reflect(ray.direction, plane.normal));
+            wf.nextRays.push({position + plane.normal * 0.001f, reflectDir}, p);
+            wf.bounces[p]++;
+            RT2_STAT(rayStats.reflectionRays++);
+        } else if (wf.hitPrim[i]) {
+            wf.shadeList.push_back(i);
+            RT2_STAT(rayStats.hits++);
+        } else {
+            wf.color[p] = Vec3(0.1f,0.1f,0.1f); // background
+        }
+    }
+}
+
+template <int Features>
+void wavefrontShadow(WavefrontBuffers& wf, const Light& light, const CompiledScene& scene, const TwoLevelBVH& bvh) {
+    wf.shadowRays.clear();
+    wf.shadowDist.clear();
+    for (int i : wf.shadeList) {
+        float dist;
+        wf.shadowRays.push(shadowRayFor<Features>(wf.hits[i], light, dist), i);
+        wf.shadowDist.push_back(dist);
+    }
+    int n = wf.shadowRays.size();
+    wf.inShadow.resize(n);
+    for (int k = 0; k < n; ++k) wf.inShadow[k] = shadowOccluded(wf.shadowRays.ray(k), wf.shadowDist[k], scene, bvh);
+}
+
+template <int Features>
+void wavefrontShade(WavefrontBuffers& wf, const Light& light) {
+    for (int k = 0; k < (int)wf.shadeList.size(); ++k) {
+        int i = wf.shadeList[k];
+        bool inShadow = (Features & RENDER_SHADOWS) && wf.inShadow[k];
+        wf.color[wf.rays.pixel[i]] = shadeLit<Features>(wf.hits[i], wf.rays.ray(i), light, inShadow);
+    }
+}
+
+// First surface of every primary ray, for the reprojection cache
+void wavefrontRecord(WavefrontBuffers& wf, const Plane& plane) {
+    for (int i = 0; i < wf.rays.size(); ++i)
+        recordFirstHit(wf.rays.ray(i), wf.hits[i], wf.hitPrim[i], plane, wf.first[wf.rays.pixel[i]]);
+}
+
+// Traces the primary rays queued in wf.rays generation by generation and leaves the final
+// colours in wf.color. Ray pixel fields index [0, pixels). Generation d holds the rays
+// trace() would see at recursion depth d. With record set, wf.first gets each pixel's
+// first surface as well.
+template <int Features>
+void traceWavefront(WavefrontBuffers& wf, const PacketKernels* kernels, const World& world, int pixels, bool record) {
+    const Plane& plane = world.floor;
+    wf.color.assign(pixels, Vec3());
+    wf.bounces.assign(pixels, 0);
+    if (record) wf.first.resize(pixels);
+
+    for (int depth = 0; depth <= 2 && wf.rays.size() > 0; ++depth) {
+        RT2_STAT(rayStats.maxDepth = std::max(rayStats.maxDepth, depth));
+        wavefrontClosestHit(wf, kernels, world.scene, world.bvh);
+        if (depth == 0 && record) wavefrontRecord(wf, plane);
+        wavefrontReflect<Features>(wf, plane);
+        if (Features & RENDER_SHADOWS) wavefrontShadow<Features>(wf, light, world.scene, world.bvh);
+        wavefrontShade<Features>(wf, light);
+        std::swap(wf.rays, wf.nextRays);
+    }
+    for (int i = 0; i < wf.rays.size(); ++i) wf.color[wf.rays.pixel[i]] = Vec3(0.1f,0.1f,0.1f); // recursion limit
+
+    // Fold the reflections back in from the deepest one, in the same order trace() returns
+    if (!(Features & RENDER_REFLECTIONS)) return;
+    Vec3 baseColor(plane.r/255.f, plane.g/255.f, plane.b/255.f);
+    for (int p = 0; p < pixels; ++p)
+        for (int b = 0; b < wf.bounces[p]; ++b) wf.color[p] = 0.3f * baseColor + 0.7f * wf.color[p];
+}
+
+void traceWavefront(WavefrontBuffers& wf, const PacketKernels* kernels, const World& world, int pixels, bool record) {
+    withFeatures(renderFeatures, [&](auto f) { traceWavefront<decltype(f)::value>(wf, kernels, world, pixels, record); });
+}
+
+// Colours for the n primary rays queued in wavefront.rays (pixel field = queue index),
+// traced wavefront style or one by one as the current mode says
+const std::vector<Vec3>& tracePrimaryBatch(const PacketKernels* packetKernels, const World& world, int n) {
+    WavefrontBuffers& wf = wavefront;
+    RT2_STAT(rayStats.primaryRays += n);
+    withFeatures(renderFeatures, [&](auto f) {
+        constexpr int F = decltype(f)::value;
+        if (useWavefront) {
+            traceWavefront<F>(wf, packetKernels, world, n, false);
+        } else {
+            wf.color.resize(n);
+            for (int k = 0; k < n; ++k) wf.color[k] = trace<F>(wf.rays.ray(k), world.scene, world.bvh, world.floor, light, 0);
+        }
+    });
+    return wf.color;
+}
+
+const int RENDER_TILE = 32; // edge of the square tiles renderFrame hands to the scheduler
+
+inline void storePixel(uint8_t* out, const Vec3& col) {
+    out[0] = std::min(255, int(std::max(0.f, col.x) * 255));
+    out[1] = std::min(255, int(std::max(0.f, col.y) * 255));
+    out[2] = std::min(255, int(std::max(0.f, col.z) * 255));
+}
+
+// Traces the pixels [x0, x1) x [y0, y1) into image (RGB, width pixels per row, starting
+// at row imageY0). One instance per projection and feature set; renderFrame picks it
+// once per frame.
+template <bool Perspective, int Features>
+void renderTile(const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                int x0, int y0, int x1, int y1, int width, int height, uint8_t* image, int imageY0) {
+    const CompiledScene& scene = world.scene;
+    const TwoLevelBVH& bvh = world.bvh;
+    const Plane& floor = world.floor;
+
+    if (useWavefront) {
+        WavefrontBuffers& wf = wavefront;
+        wavefrontGenerate<Perspective>(wf, cam, x0, y0, x1, y1, width, height);
+        traceWavefront<Features>(wf, packetKernels, world, (x1 - x0) * (y1 - y0), false);
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x) storePixel(image + 3 * (size_t(y - imageY0) * width + x), wf.color[(y - y0) * (x1 - x0) + (x - x0)]);
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y) {
+        uint8_t* row = image + 3 * size_t(y - imageY0) * width;
+        if (!packetKernels) {
+            for (int x = x0; x < x1; ++x)
+                storePixel(row + 3 * x, trace<Features>(cameraRay<Perspective>(cam, x + 0.5f, y + 0.5f, width, height), scene, bvh, floor, light, 0));
+            continue;
+        }
+
+        // Find the closest sphere/triangle for 8 neighbouring pixels at once, then finish each ray alone
+        for (int xs = x0; xs < x1; xs += RayPacket::SIZE) {
+            int n = std::min(RayPacket::SIZE, x1 - xs);
+            Ray rays[RayPacket::SIZE];
+            RayPacket packet;
+            PacketHit hits;
+            for (int i = 0; i < RayPacket::SIZE; ++i) {
+                rays[i] = cameraRay<Perspective>(cam, xs + std::min(i, n - 1) + 0.5f, y + 0.5f, width, height);
+                packet.ox[i] = rays[i].origin.x; packet.oy[i] = rays[i].origin.y; packet.oz[i] = rays[i].origin.z;
+                packet.dx[i] = rays[i].direction.x; packet.dy[i] = rays[i].direction.y; packet.dz[i] = rays[i].direction.z;
+                packet.idx[i] = 1.f / packet.dx[i]; packet.idy[i] = 1.f / packet.dy[i]; packet.idz[i] = 1.f / packet.dz[i];
+                hits.t[i] = i < n ? 1e20f : 0.f;
+                hits.id[i] = -1;
+            }
+
+            intersectScenePacket(packet, *packetKernels, scene, bvh, hits);
+
+            for (int i = 0; i < n; ++i) {
+                HitInfo hit;
+                hit.t = hits.t[i];
+                bool hitSomething = hits.id[i] >= 0;
+                if (hitSomething) setHitInfo(rays[i], hits, i, scene, hit);
+                storePixel(row + 3 * (xs + i), finishTrace<Features>(rays[i], hit, hitSomething, scene, bvh, floor, light, 0));
+            }
+        }
+    }
+}
+
+using TileKernel = void (*)(const PacketKernels*, const World&, const Camera&, int, int, int, int, int, int, uint8_t*, int);
+
+TileKernel selectTileKernel(bool perspective, int features) {
+    return withFeatures(features, [&](auto f) -> TileKernel {
+        constexpr int F = decltype(f)::value;
+        return perspective ? renderTile<true, F> : renderTile<false, F>;
+    });
+}
+
+// Renders one frame into image (RGB, bottom row first) and adds its counters to frameStats.
+// With a tile list (indices in row-major RENDER_TILE tiles) only those tiles are written,
+// and image may then hold just the rows from imageY0 on that the tiles cover.
+void renderFrame(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                 int width, int height, uint8_t* image, [[maybe_unused]] RayStats& frameStats, const std::vector<int>* tiles = nullptr,
+                 int imageY0 = 0) {
+    // Projection and features are fixed for the frame, so the branches on them are resolved here
+    TileKernel kernel = selectTileKernel(cam.perspective, renderFeatures);
+    newOccluderGeneration();
+
+    // Generate rays per pixel, one tile per task
+    const int TILE = RENDER_TILE;
+    const int tilesX = (width + TILE - 1) / TILE, tilesY = (height + TILE - 1) / TILE;
+    std::mutex statsMutex;
+    scheduler.run(tiles ? (int)tiles->size() : tilesX * tilesY, [&](int task) {
+        int tile = tiles ? (*tiles)[task] : task;
+        int x0 = (tile % tilesX) * TILE, y0 = (tile / tilesX) * TILE;
+        int x1 = std::min(x0 + TILE, width), y1 = std::min(y0 + TILE, height);
+        kernel(packetKernels, world, cam, x0, y0, x1, y1, width, height, image, imageY0);
+
+#if RT2_STATS
+        // Fold this thread's counters into the frame total
+        rayStats.primaryRays += uint64_t(x1 - x0) * (y1 - y0);
+        std::lock_guard<std::mutex> lock(statsMutex);
+        frameStats += rayStats;
+        rayStats = RayStats();
+#endif
+    });
+}
+
+// Temporal reprojection: each pixel remembers the first surface its ray hit and the
+// colour it got. Next frame these points are projected into the new view, and a pixel
+// that receives one keeps that colour unless it has to be retraced: nothing landed on it
+// (disocclusion), the point sits on a silhouette, the view direction has turned too far
+// for the specular and floor reflection to hold, the ray, shadow or reflection path
+// passes a moving sphere's swept bounds, or it is due in the rotating refresh.
+struct ReprojectionCache {
+    static const int REFRESH = 16;          // every pixel is retraced at least this often
+    static constexpr float MAX_TURN = 0.99939f; // cos(2 deg), view change a colour survives
+    static constexpr float MAX_STEP = 0.03f;    // colour difference to a neighbour that marks an edge
+    int width = 0, height = 0;
+    bool perspective = true;
+    int frame = 0;
+    std::vector<CachedPixel> pixels, next;
+    std::unique_ptr<std::atomic<uint64_t>[]> owner; // per pixel: depth bits << 32 | source pixel
+    std::vector<AABB> movingBounds;         // moving spheres as of the last frame
+};
+
+// Inverse of primaryRay for an offset d from the camera: screen position in pixels, not
+// clamped to the image, and distance along the view axis. False behind the camera.
+bool projectOffset(const Camera& cam, const Vec3& d, int width, int height, float& fx, float& fy, float& depth) {
+    depth = d.dot(cam.dir);
+    if (depth <= 1e-4f) return false;
+    float scale = cam.perspective ? depth * cam.perspectiveScale : cam.orthoScale;
+    float ndcX = d.dot(cam.right) / (scale * cam.aspect), ndcY = d.dot(cam.up) / scale;
+    fx = (ndcX + 1.f) * 0.5f * width; fy = (ndcY + 1.f) * 0.5f * height;
+    return true;
+}
+
+// Pixel a cached point lands on and its distance along the view axis. Background is a
+// direction, which only a perspective camera can place again.
+bool projectToPixel(const Camera& cam, const CachedPixel& c, int width, int height, int& x, int& y, float& depth) {
+    bool background = c.state == CachedPixel::BACKGROUND;
+    if (background && !cam.perspective) return false;
+    float fx, fy;
+    if (!projectOffset(cam, background ? c.viewDir : c.position - cam.pos, width, height, fx, fy, depth)) return false;
+    if (fx < 0.f || fy < 0.f || fx >= width || fy >= height) return false;
+    x = int(fx); y = int(fy);
+    if (background) depth = 1e30f; // behind every surface
+    return true;
+}
+
+bool segmentTouches(const Ray& ray, float tMax, const std::vector<AABB>& boxes) {
+    Vec3 invDir(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+    float tNear;
+    for (const AABB& box : boxes) if (intersectAABB(ray, invDir, box, tMax, tNear)) return true;
+    return false;
+}
+
+// trace() for a primary ray that also records its first surface for the cache
+Vec3 traceAndRecord(const Ray& ray, const World& world, CachedPixel& out) {
+    HitInfo hit;
+    hit.t = 1e20f;
+    bool hitSomething = intersectScene(ray, world.scene, world.bvh, hit);
+    recordFirstHit(ray, hit, hitSomething, world.floor, out);
+    out.color = finishTrace(ray, hit, hitSomething, world.scene, world.bvh, world.floor, light);
+    return out.color;
+}
+
+// Whether a cached point may keep its colour in the new view
+bool reusable(const ReprojectionCache& cache, int src, const Camera& cam, const std::vector<AABB>& swept) {
+    const CachedPixel& c = cache.pixels[src];
+    if (c.age + 1 >= ReprojectionCache::REFRESH) return false;
+
+    int sx = src % cache.width, sy = src / cache.width;
+    const int nx[4] = {-1, 1, 0, 0}, ny[4] = {0, 0, -1, 1};
+    if (c.state == CachedPixel::BACKGROUND) {
+        // Still background if no neighbour is a surface and no moving sphere got in the way
+        for (int k = 0; k < 4; ++k) {
+            int x = sx + nx[k], y = sy + ny[k];
+            if (x < 0 || y < 0 || x >= cache.width || y >= cache.height) continue;
+            if (cache.pixels[y * cache.width + x].state != CachedPixel::BACKGROUND) return false;
+        }
+        return !segmentTouches({cam.pos, c.viewDir}, 1e20f, swept);
+    }
+
+    Vec3 toCam = cam.perspective ? cam.pos - c.position : cam.dir * -1.f;
+    float dist = toCam.length();
+    Vec3 view = toCam * (-1.f / dist);
+    if (view.dot(c.viewDir) < ReprojectionCache::MAX_TURN) return false;
+
+    // Edges: a neighbour on another surface, at a different depth or of a different
+    // colour (shadow and highlight borders), where the sub-pixel shift of the point shows
+    for (int k = 0; k < 4; ++k) {
+        int x = sx + nx[k], y = sy + ny[k];
+        if (x < 0 || y < 0 || x >= cache.width || y >= cache.height) continue;
+        const CachedPixel& n = cache.pixels[y * cache.width + x];
+        if (n.state != c.state || n.normal.dot(c.normal) < 0.95f || (n.position - c.position).length() > 0.05f * dist)
+            return false;
+        Vec3 d = n.color - c.color;
+        if (std::max({std::fabs(d.x), std::fabs(d.y), std::fabs(d.z)}) > ReprojectionCache::MAX_STEP) return false;
+    }
+
+    // Moving spheres: on the point, in front of it, in its shadow ray or in its reflection
+    for (const AABB& box : swept) {
+        if (c.position.x >= box.min.x && c.position.y >= box.min.y && c.position.z >= box.min.z &&
+            c.position.x <= box.max.x && c.position.y <= box.max.y && c.position.z <= box.max.z) return false;
+    }
+    Ray back = {c.position, toCam * (1.f / dist)};
+    if (segmentTouches(back, cam.perspective ? dist : 1e20f, swept)) return false;
+    Ray bounce = {c.position + c.normal * 0.001f, c.state == CachedPixel::FLOOR
+        ? reflect(view, c.normal).normalize() : (light.position - c.position).normalize()};
+    float bounceMax = c.state == CachedPixel::FLOOR ? 1e20f : (light.position - c.position).length();
+    return !segmentTouches(bounce, bounceMax, swept);
+}
+
+// renderFrame with the reprojection cache. Only the pixels that fail reusable() are traced.
+void renderFrameCached(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                       int width, int height, uint8_t* image, [[maybe_unused]] RayStats& frameStats, ReprojectionCache& cache) {
+    newOccluderGeneration();
+    const size_t count = size_t(width) * height;
+    std::vector<AABB> current;
+    for (int i : world.movingSpheres) current.push_back(sphereBounds(world.scene, i));
+
+    // Anything cached for another size or projection is useless
+    bool warm = cache.width == width && cache.height == height && cache.perspective == cam.perspective &&
+                cache.movingBounds.size() == current.size();
+    if (cache.width != width || cache.height != height) {
+        cache.pixels.assign(count, CachedPixel());
+        cache.next.assign(count, CachedPixel());
+        cache.owner.reset(new std::atomic<uint64_t>[count]);
+        cache.width = width; cache.height = height;
+    }
+    cache.perspective = cam.perspective;
+
+    // Swept bounds: where each moving sphere was last frame and where it is now
+    std::vector<AABB> swept = current;
+    for (size_t i = 0; warm && i < swept.size(); ++i) swept[i].grow(cache.movingBounds[i]);
+    cache.movingBounds = current;
+
+    // Forward-project last frame's points; the nearest one per pixel wins
+    const int ROWS = 16;
+    const int tasks = (height + ROWS - 1) / ROWS;
+    for (size_t i = 0; i < count; ++i) cache.owner[i].store(~uint64_t(0), std::memory_order_relaxed);
+    if (warm) {
+        scheduler.run(tasks, [&](int task) {
+            for (int y = task * ROWS; y < std::min(height, (task + 1) * ROWS); ++y) {
+                for (int x = 0; x < width; ++x) {
+                    int src = y * width + x;
+                    if (cache.pixels[src].state == CachedPixel::EMPTY) continue;
+                    int tx, ty; float depth;
+                    if (!projectToPixel(cam, cache.pixels[src], width, height, tx, ty, depth)) continue;
+                    uint32_t depthBits;
+                    memcpy(&depthBits, &depth, sizeof(depthBits)); // positive floats order like their bits
+                    uint64_t key = (uint64_t(depthBits) << 32) | uint32_t(src);
+                    std::atomic<uint64_t>& slot = cache.owner[size_t(ty) * width + tx];
+                    uint64_t prev = slot.load(std::memory_order_relaxed);
+                    while (key < prev && !slot.compare_exchange_weak(prev, key, std::memory_order_relaxed)) {}
+                }
+            }
+        });
+    }
+
+    auto writePixel = [&](size_t i, const Vec3& col) {
+        image[3 * i]     = std::min(255, int(std::max(0.f, col.x) * 255));
+        image[3 * i + 1] = std::min(255, int(std::max(0.f, col.y) * 255));
+        image[3 * i + 2] = std::min(255, int(std::max(0.f, col.z) * 255));
+    };
+
+    // Keep what can be kept, then trace the rest of the band in one wavefront batch
+    int phase = cache.frame++ % ReprojectionCache::REFRESH;
+    std::mutex statsMutex;
+    scheduler.run(tasks, [&](int task) {
+        std::vector<int> retrace;
+        for (int y = task * ROWS; y < std::min(height, (task + 1) * ROWS); ++y) {
+            for (int x = 0; x < width; ++x) {
+                size_t i = size_t(y) * width + x;
+                uint64_t key = cache.owner[i].load(std::memory_order_relaxed);
+                bool refresh = (x + 7 * y) % ReprojectionCache::REFRESH == phase;
+                if (key != ~uint64_t(0) && !refresh && reusable(cache, int(key & 0xffffffffu), cam, swept)) {
+                    CachedPixel& out = cache.next[i];
+                    out = cache.pixels[key & 0xffffffffu];
+                    out.age++;
+                    writePixel(i, out.color);
+                    RT2_STAT(rayStats.reusedPixels++);
+                } else {
+                    retrace.push_back(int(i));
+                }
+            }
+        }
+        RT2_STAT(rayStats.primaryRays += retrace.size());
+
+        if (!useWavefront) {
+            for (int i : retrace) writePixel(i, traceAndRecord(primaryRay(cam, i % width, i / width, width, height), world, cache.next[i]));
+        } else {
+            WavefrontBuffers& wf = wavefront;
+            wf.rays.clear();
+            for (int k = 0; k < (int)retrace.size(); ++k) wf.rays.push(primaryRay(cam, retrace[k] % width, retrace[k] / width, width, height), k);
+            traceWavefront(wf, packetKernels, world, (int)retrace.size(), true);
+            for (int k = 0; k < (int)retrace.size(); ++k) {
+                CachedPixel& out = cache.next[retrace[k]];
+                out = wf.first[k];
+                out.color = wf.color[k];
+                writePixel(retrace[k], out.color);
+            }
+        }
+#if RT2_STATS
+        std::lock_guard<std::mutex> lock(statsMutex);
+        frameStats += rayStats;
+        rayStats = RayStats();
+#endif
+    });
+    std::swap(cache.pixels, cache.next);
+}
+
+// Incremental rendering for a still camera: the last frame is kept and only the tiles a
+// moving sphere can have changed are traced again. A sphere reaches the pixels that see
+// it, that see its shadow, and that see either of them in the floor reflection.
+struct DirtyRegionCache {
+    std::vector<uint8_t> image;     // last frame, complete
+    int width = 0, height = 0;
+    Camera cam;
+    std::vector<AABB> movingBounds; // moving spheres as of the last frame
+};
+
+bool sameView(const Camera& a, const Camera& b) {
+    return a.perspective == b.perspective && a.aspect == b.aspect &&
+           a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z &&
+           a.dir.x == b.dir.x && a.dir.y == b.dir.y && a.dir.z == b.dir.z;
+}
+
+// Marks the tiles whose pixels a change inside box can affect. The shadow lies in the
+// hull of the box and its projection from the light onto the floor, and the reflection
+// in the mirror image of that hull, so the screen rectangles of those two point sets
+// bound everything. False when the footprint is unbounded (the box reaches the light's
+// height or goes behind the camera); then the whole frame has to be traced.
+bool markFootprint(const AABB& box, const Camera& cam, const Plane& floor, int width, int height,
+                   int tilesX, std::vector<uint8_t>& dirty) {
+    Vec3 direct[16], mirrored[16];
+    float lightHeight = (light.position - floor.point).dot(floor.normal);
+    for (int k = 0; k < 8; ++k) {
+        Vec3 p(k & 1 ? box.max.x : box.min.x, k & 2 ? box.max.y : box.min.y, k & 4 ? box.max.z : box.min.z);
+        Vec3 toPoint = p - light.position;
+        float fall = toPoint.dot(floor.normal);
+        if (lightHeight <= 0.f || fall >= 0.f) return false;
+        Vec3 shadow = light.position + toPoint * (lightHeight / -fall);
+        direct[k] = p;
+        mirrored[k] = p - floor.normal * (2.f * (p - floor.point).dot(floor.normal));
+        direct[8 + k] = mirrored[8 + k] = shadow; // on the floor, its own mirror image
+    }
+
+    for (const Vec3* points : {direct, mirrored}) {
+        float x0 = 1e30f, y0 = 1e30f, x1 = -1e30f, y1 = -1e30f;
+        for (int k = 0; k < 16; ++k) {
+            float fx, fy, depth;
+            if (!projectOffset(cam, points[k] - cam.pos, width, height, fx, fy, depth)) return false;
+            x0 = std::min(x0, fx); x1 = std::max(x1, fx);
+            y0 = std::min(y0, fy); y1 = std::max(y1, fy);
+        }
+        // One pixel of slack for rounding at the rectangle's edge
+        if (x1 < -1.f || y1 < -1.f || x0 > width + 1.f || y0 > height + 1.f) continue; // off screen
+        int tx0 = int(std::max(0.f, x0 - 1.f)) / RENDER_TILE, tx1 = int(std::min(width - 1.f, x1 + 1.f)) / RENDER_TILE;
+        int ty0 = int(std::max(0.f, y0 - 1.f)) / RENDER_TILE, ty1 = int(std::min(height - 1.f, y1 + 1.f)) / RENDER_TILE;
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx) dirty[ty * tilesX + tx] = 1;
+    }
+    return true;
+}
+
+// renderFrame that retraces only the dirty tiles while the camera holds still. Any camera,
+// size or projection change renders the whole frame, which becomes the new base.
+void renderFrameIncremental(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                            int width, int height, uint8_t* image, RayStats& frameStats, DirtyRegionCache& cache) {
+    const size_t imageSize = size_t(width) * height * 3;
+    const int tilesX = (width + RENDER_TILE - 1) / RENDER_TILE, tilesY = (height + RENDER_TILE - 1) / RENDER_TILE;
+    std::vector<AABB> current;
+    for (int i : world.movingSpheres) current.push_back(sphereBounds(world.scene, i));
+
+    bool warm = cache.width == width && cache.height == height && sameView(cache.cam, cam) &&
+                cache.movingBounds.size() == current.size();
+    std::vector<uint8_t> dirty(size_t(tilesX) * tilesY, 0);
+    for (size_t i = 0; warm && i < current.size(); ++i) {
+        AABB swept = current[i];
+        swept.grow(cache.movingBounds[i]);
+        warm = markFootprint(swept, cam, world.floor, width, height, tilesX, dirty);
+    }
+    cache.movingBounds = current;
+    cache.cam = cam;
+
+    if (!warm) {
+        cache.image.resize(imageSize);
+        cache.width = width; cache.height = height;
+        renderFrame(scheduler, packetKernels, world, cam, width, height, cache.image.data(), frameStats);
+    } else {
+        std::vector<int> tiles;
+        for (int t = 0; t < tilesX * tilesY; ++t) if (dirty[t]) tiles.push_back(t);
+        if (!tiles.empty()) renderFrame(scheduler, packetKernels, world, cam, width, height, cache.image.data(), frameStats, &tiles);
+        RT2_STAT(frameStats.reusedPixels += uint64_t(width) * height - frameStats.primaryRays);
+    }
+    memcpy(image, cache.image.data(), imageSize);
+}
+
+// Progressive refinement: while the view and the scene stay the same, every frame carries
+// on refining the last one for as long as the frame budget allows. Pass 0 traces one ray
+// per 8x8 block, passes 1-3 halve the blocks down to one ray per pixel (the image
+// renderFrame gives), and the last passes add 2x2 stratified sub-pixel samples. Work is
+// handed out in row bands, and a band that starts after the budget is left for the next
+// frame. Any change starts over from pass 0, which always runs in full.
+class ProgressiveRenderer {
+public:
+    // Adds at most maxPasses passes, stopping early once budgetMs is spent; a budget of 0
+    // has no time limit, so the frame does not depend on how fast it was traced
+    void render(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                int width, int height, double budgetMs, int maxPasses, uint8_t* image, RayStats& frameStats);
+    int passesDone() const { return pass; }
+    static constexpr int PASSES = 4 + 4; // block sizes 8, 4, 2, 1, then 4 sub-pixel samples
+
+private:
+    static const int BLOCK = 8;
+    static const int BAND = 32; // rows per task, a multiple of BLOCK
+    void traceBand(const PacketKernels* packetKernels, const World& world, int band, int p);
+
+    int width = 0, height = 0;
+    Camera cam;
+    std::vector<AABB> movingBounds;
+    std::vector<Vec3> sum;        // per pixel: sum of its samples
+    std::vector<uint8_t> samples; // per pixel: samples in sum
+    std::vector<int> bandPass;    // per band: passes finished
+    int pass = 0;                 // every band has finished the passes before this one
+};
+
+// Traces pass p for the rows of one band
+void ProgressiveRenderer::traceBand(const PacketKernels* packetKernels, const World& world, int band, int p) {
+    int y0 = band * BAND, y1 = std::min(height, y0 + BAND);
+    int step = p < 4 ? BLOCK >> p : 1;
+    float ox = 0.5f, oy = 0.5f;
+    if (p >= 4) {
+        ox = 0.25f + 0.5f * ((p - 4) & 1);
+        oy = 0.25f + 0.5f * ((p - 4) >> 1);
+    }
+
+    std::vector<int> targets;
+    WavefrontBuffers& wf = wavefront;
+    wf.rays.clear();
+    for (int y = y0; y < y1; y += step) {
+        for (int x = 0; x < width; x += step) {
+            // Samples on the coarser grid were traced by an earlier pass
+            if (p > 0 && p < 4 && x % (2 * step) == 0 && y % (2 * step) == 0) continue;
+            wf.rays.push(primaryRayAt(cam, x + ox, y + oy, width, height), (int)targets.size());
+            targets.push_back(y * width + x);
+        }
+    }
+    const int n = (int)targets.size();
+    const std::vector<Vec3>& color = tracePrimaryBatch(packetKernels, world, n);
+
+    for (int k = 0; k < n; ++k) {
+        int x = targets[k] % width, y = targets[k] / width;
+        if (p >= 4) {
+            sum[targets[k]] = sum[targets[k]] + color[k];
+            samples[targets[k]]++;
+            continue;
+        }
+        for (int by = y; by < std::min(y + step, y1); ++by) {
+            for (int bx = x; bx < std::min(x + step, width); ++bx) {
+                sum[by * width + bx] = color[k];
+                samples[by * width + bx] = 1;
+            }
+        }
+    }
+}
+
+void ProgressiveRenderer::render(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& view,
+                                 int w, int h, double budgetMs, int maxPasses, uint8_t* image, [[maybe_unused]] RayStats& frameStats) {
+    auto start = std::chrono::high_resolution_clock::now();
+    newOccluderGeneration();
+    const int bands = (h + BAND - 1) / BAND;
+    std::vector<AABB> current;
+    for (int i : world.movingSpheres) current.push_back(sphereBounds(world.scene, i));
+
+    bool same = w == width && h == height && sameView(view, cam) && current.size() == movingBounds.size();
+    for (size_t i = 0; same && i < current.size(); ++i) {
+        same = current[i].min.x == movingBounds[i].min.x && current[i].min.y == movingBounds[i].min.y &&
+               current[i].min.z == movingBounds[i].min.z && current[i].max.x == movingBounds[i].max.x &&
+               current[i].max.y == movingBounds[i].max.y && current[i].max.z == movingBounds[i].max.z;
+    }
+    if (!same) {
+        width = w; height = h;
+        cam = view;
+        movingBounds = current;
+        sum.assign(size_t(w) * h, Vec3());
+        samples.assign(size_t(w) * h, 0);
+        bandPass.assign(bands, 0);
+        pass = 0;
+    }
+
+    std::mutex statsMutex;
+    const int lastPass = std::min(PASSES, pass + maxPasses);
+    while (pass < lastPass) {
+        scheduler.run(bands, [&](int band) {
+            if (bandPass[band] > pass) return;
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            if (pass > 0 && budgetMs > 0.0 && elapsed > budgetMs) return;
+            traceBand(packetKernels, world, band, pass);
+            bandPass[band] = pass + 1;
+#if RT2_STATS
+            std::lock_guard<std::mutex> lock(statsMutex);
+            frameStats += rayStats;
+            rayStats = RayStats();
+#endif
+        });
+        if (*std::min_element(bandPass.begin(), bandPass.end()) <= pass) break; // out of time
+        pass++;
+    }
+
+    // Show the mean of each pixel's samples
+    scheduler.run(bands, [&](int band) {
+        for (size_t i = size_t(band) * BAND * width; i < std::min(size_t(band + 1) * BAND, size_t(height)) * width; ++i) {
+            Vec3 col = samples[i] > 1 ? sum[i] * (1.f / samples[i]) : sum[i];
+            image[3 * i]     = std::min(255, int(std::max(0.f, col.x) * 255));
+            image[3 * i + 1] = std::min(255, int(std::max(0.f, col.y) * 255));
+            image[3 * i + 2] = std::min(255, int(std::max(0.f, col.z) * 255));
+        }
+    });
+}
+
+// Adaptive supersampling. Every pixel first gets its centre ray, as in renderFrame. Where
+// that colour differs from a neighbour's (an edge), the pixel is split into n x n strata
+// and traced with one jittered ray in a stratum of each quadrant; if those four still
+// disagree, the remaining strata are traced too. A supersampled pixel is the mean of its
+// stratified samples. Jitter and stratum order come from a random stream seeded by the
+// pixel position alone, so the image does not depend on threads or scheduling.
+const float AA_CONTRAST = 0.04f; // channel difference that calls for more samples
+
+float maxChannelDiff(const Vec3& a, const Vec3& b) {
+    return std::max({std::fabs(a.x - b.x), std::fabs(a.y - b.y), std::fabs(a.z - b.z)});
+}
+
+unsigned pixelSeed(int x, int y) {
+    uint32_t h = uint32_t(x) * 0x85ebca6bu ^ uint32_t(y) * 0xc2b2ae35u;
+    h ^= h >> 16; h *= 0x7feb352du; h ^= h >> 15;
+    return h;
+}
+
+// Sample positions inside pixel (x, y) for an n x n grid: each lies at a random spot in its
+// stratum, and every group of four covers the four quadrants once, so any prefix of a
+// multiple of four samples is spread over the whole pixel
+void stratifiedSamples(int x, int y, int n, std::vector<float>& pos) {
+    SceneRng rng(pixelSeed(x, y));
+    const int half = n / 2, perQuadrant = half * half;
+    int quadrant[4][16]; // stratum order per quadrant, n <= 8
+    for (int q = 0; q < 4; ++q) {
+        for (int s = 0; s < perQuadrant; ++s) quadrant[q][s] = s;
+        for (int s = perQuadrant - 1; s > 0; --s) std::swap(quadrant[q][s], quadrant[q][int(rng.next(0.f, 0.9999f) * (s + 1))]);
+    }
+    pos.clear();
+    for (int k = 0; k < perQuadrant; ++k) {
+        for (int q = 0; q < 4; ++q) {
+            int sx = (q & 1) * half + quadrant[q][k] % half, sy = (q >> 1) * half + quadrant[q][k] / half;
+            pos.push_back(x + (sx + rng.next(0.f, 1.f)) / n);
+            pos.push_back(y + (sy + rng.next(0.f, 1.f)) / n);
+        }
+    }
+}
+
+// renderFrame with up to maxSamples (n * n, n even) rays per pixel at edges
+void renderFrameAA(TileScheduler& scheduler, const PacketKernels* packetKernels, const World& world, const Camera& cam,
+                   int width, int height, int maxSamples, uint8_t* image, [[maybe_unused]] RayStats& frameStats) {
+    newOccluderGeneration();
+    const int n = (int)std::lround(std::sqrt(float(maxSamples)));
+    const int ROWS = 16;
+    const int tasks = (height + ROWS - 1) / ROWS;
+    std::vector<Vec3> centre(size_t(width) * height);
+    std::mutex statsMutex;
+    auto mergeStats = [&] {
+#if RT2_STATS
+        std::lock_guard<std::mutex> lock(statsMutex);
+        frameStats += rayStats;
+        rayStats = RayStats();
+#endif
+    };
+
+    // Centre samples first, in renderFrame's tiles: the edge test needs the neighbours in other bands
+    const int tilesX = (width + RENDER_TILE - 1) / RENDER_TILE, tilesY = (height + RENDER_TILE - 1) / RENDER_TILE;
+    scheduler.run(tilesX * tilesY, [&](int tile) {
+        int x0 = (tile % tilesX) * RENDER_TILE, y0 = (tile / tilesX) * RENDER_TILE;
+        int x1 = std::min(x0 + RENDER_TILE, width), y1 = std::min(y0 + RENDER_TILE, height);
+        wavefrontGenerate(wavefront, cam, x0, y0, x1, y1, width, height);
+        const std::vector<Vec3>& color = tracePrimaryBatch(packetKernels, world, (x1 - x0) * (y1 - y0));
+        for (int y = y0; y < y1; ++y)
+            std::copy(color.begin() + (y - y0) * (x1 - x0), color.begin() + (y - y0 + 1) * (x1 - x0), centre.begin() + size_t(y) * width + x0);
+        mergeStats();
+    });
+
+    scheduler.run(tasks, [&](int task) {
+        int y0 = task * ROWS, y1 = std::min(height, y0 + ROWS);
+        // Edge pixels: each neighbouring pair is compared once and marks both sides
+        std::vector<uint8_t> isEdge(size_t(y1 - y0) * width, 0);
+        auto mark = [&](int x, int y) { if (y >= y0 && y < y1) isEdge[size_t(y - y0) * width + x] = 1; };
+        for (int y = std::max(y0 - 1, 0); y < std::min(y1, height - 1); ++y) {
+            const Vec3* row = &centre[size_t(y) * width];
+            for (int x = 0; x < width; ++x)
+                if (maxChannelDiff(row[x], row[x + width]) > AA_CONTRAST) { mark(x, y); mark(x, y + 1); }
+        }
+        for (int y = y0; y < y1; ++y) {
+            const Vec3* row = &centre[size_t(y) * width];
+            for (int x = 0; x + 1 < width; ++x)
+                if (maxChannelDiff(row[x], row[x + 1]) > AA_CONTRAST) { mark(x, y); mark(x + 1, y); }
+        }
+        std::vector<int> edges;
+        for (size_t i = 0; i < isEdge.size(); ++i) if (isEdge[i]) edges.push_back(y0 * width + int(i));
+
+        // Round one: a sample per quadrant for every edge pixel
+        const int E = (int)edges.size();
+        std::vector<float> positions(size_t(E) * maxSamples * 2);
+        std::vector<float> pos;
+        wavefront.rays.clear();
+        for (int e = 0; e < E; ++e) {
+            stratifiedSamples(edges[e] % width, edges[e] / width, n, pos);
+            std::copy(pos.begin(), pos.end(), positions.begin() + size_t(e) * maxSamples * 2);
+            for (int s = 0; s < 4; ++s)
+                wavefront.rays.push(primaryRayAt(cam, pos[2 * s], pos[2 * s + 1], width, height), e * 4 + s);
+        }
+        std::vector<Vec3> sum(E);
+        std::vector<int> refine;
+        const std::vector<Vec3>& first = tracePrimaryBatch(packetKernels, world, E * 4);
+        for (int e = 0; e < E; ++e) {
+            Vec3 lo = first[e * 4], hi = first[e * 4];
+            for (int s = 0; s < 4; ++s) {
+                const Vec3& c = first[e * 4 + s];
+                sum[e] = sum[e] + c;
+                lo = Vec3(std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z));
+                hi = Vec3(std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z));
+            }
+            if (maxSamples > 4 && maxChannelDiff(lo, hi) > AA_CONTRAST) refine.push_back(e);
+        }
+
+        // Round two: the remaining strata where the quadrants disagree
+        const int rest = maxSamples - 4;
+        wavefront.rays.clear();
+        for (int k = 0; k < (int)refine.size(); ++k) {
+            const float* p = &positions[size_t(refine[k]) * maxSamples * 2];
+            for (int s = 4; s < maxSamples; ++s)
+                wavefront.rays.push(primaryRayAt(cam, p[2 * s], p[2 * s + 1], width, height), k * rest + s - 4);
+        }
+        if (!refine.empty()) {
+            const std::vector<Vec3>& second = tracePrimaryBatch(packetKernels, world, (int)refine.size() * rest);
+            for (int k = 0; k < (int)refine.size(); ++k)
+                for (int s = 0; s < rest; ++s) sum[refine[k]] = sum[refine[k]] + second[k * rest + s];
+        }
+
+        // Centre colours stay untouched, the neighbouring bands may still be reading them
+        auto writePixel = [&](size_t i, const Vec3& col) {
+            image[3 * i]     = std::min(255, int(std::max(0.f, col.x) * 255));
+            image[3 * i + 1] = std::min(255, int(std::max(0.f, col.y) * 255));
+            image[3 * i + 2] = std::min(255, int(std::max(0.f, col.z) * 255));
+        };
+        for (size_t i = size_t(y0) * width; i < size_t(y1) * width; ++i) writePixel(i, centre[i]);
+        std::vector<int> count(E, 4);
+        for (int e : refine) count[e] = maxSamples;
+        for (int e = 0; e < E; ++e) writePixel(edges[e], sum[e] * (1.f / count[e]));
+        RT2_STAT(rayStats.supersampledPixels += E);
+        mergeStats();
+    });
+}
+
+// Upscales an RGB image (bottom row first, like the rest). Each output pixel blends the
+// 2x2 nearest source pixels with bilinear weights, cut down for samples whose colour
+// differs strongly from the closest one, so edges stay sharp instead of smearing.
+void upscaleEdgeAware(TileScheduler& scheduler, const uint8_t* src, int sw, int sh, uint8_t* dst, int dw, int dh) {
+    // Edge falloff by summed RGB difference; the weight halves at a difference of 24
+    static float edgeWeight[3 * 255 + 1];
+    static std::once_flag edgeWeightInit;
+    std::call_once(edgeWeightInit, [] {
+        for (int d = 0; d <= 3 * 255; ++d) edgeWeight[d] = 1.f / (1.f + float(d * d) / (24.f * 24.f));
+    });
+
+    // Source column and bilinear weight for every output column, shared by all rows
+    struct Tap { int x0, x1; float t; };
+    std::vector<Tap> columns(dw);
+    for (int x = 0; x < dw; ++x) {
+        float fx = (x + 0.5f) * sw / dw - 0.5f;
+        int x0 = std::min(std::max(int(std::floor(fx)), 0), sw - 1);
+        columns[x] = {3 * x0, 3 * std::min(x0 + 1, sw - 1), std::min(std::max(fx - x0, 0.f), 1.f)};
+    }
+
+    const int ROWS = 16;
+    scheduler.run((dh + ROWS - 1) / ROWS, [&](int task) {
+        for (int y = task * ROWS; y < std::min(dh, (task + 1) * ROWS); ++y) {
+            float fy = (y + 0.5f) * sh / dh - 0.5f;
+            int y0 = std::min(std::max(int(std::floor(fy)), 0), sh - 1), y1 = std::min(y0 + 1, sh - 1);
+            float ty = std::min(std::max(fy - y0, 0.f), 1.f);
+            const uint8_t* row0 = src + 3 * y0 * sw;
+            const uint8_t* row1 = src + 3 * y1 * sw;
+            uint8_t* out = dst + 3 * y * dw;
+            for (int x = 0; x < dw; ++x, out += 3) {
+                const Tap& c = columns[x];
+                const uint8_t* p[4] = {row0 + c.x0, row0 + c.x1, row1 + c.x0, row1 + c.x1};
+                float bilinear[4] = {(1 - c.t) * (1 - ty), c.t * (1 - ty), (1 - c.t) * ty, c.t * ty};
+                const uint8_t* nearest = p[(c.t >= 0.5f) + 2 * (ty >= 0.5f)];
+
+                float r = 0.f, g = 0.f, b = 0.f, weightSum = 0.f;
+                for (int k = 0; k < 4; ++k) {
+                    int diff = std::abs(p[k][0] - nearest[0]) + std::abs(p[k][1] - nearest[1]) + std::abs(p[k][2] - nearest[2]);
+                    float w = bilinear[k] * edgeWeight[diff];
+                    r += w * p[k][0]; g += w * p[k][1]; b += w * p[k][2];
+                    weightSum += w;
+                }
+                float inv = 1.f / weightSum;
+                out[0] = uint8_t(std::min(255.f, r * inv + 0.5f));
+                out[1] = uint8_t(std::min(255.f, g * inv + 0.5f));
+                out[2] = uint8_t(std::min(255.f, b * inv + 0.5f));
+            }
+        }
+    });
+}
+
+// Picks the internal render resolution for a target frame time. Tracing cost follows the
+// pixel count, so the scale moves by the square root of the time ratio, limited per frame
+// and with a dead band so it settles instead of oscillating.
+struct ResolutionController {
+    float targetMs = 0.f; // 0 keeps full resolution
+    float scale = 1.f;
+    static constexpr float MIN_SCALE = 0.25f;
+
+    void update(double frameMs) {
+        if (targetMs <= 0.f) return;
+        float step = std::sqrt(targetMs / float(std::max(frameMs, 0.1)));
+        if (std::fabs(step - 1.f) < 0.05f) return;
+        step = std::min(std::max(step, 0.8f), 1.1f);
+        scale = std::min(std::max(scale * step, MIN_SCALE), 1.f);
+    }
+    // Width is kept a multiple of 8 so rows fill whole ray packets
+    int width(int full) const { return scale >= 1.f ? full : std::max(8, int(full * scale) / 8 * 8); }
+    int height(int full) const { return scale >= 1.f ? full : std::max(1, int(full * scale)); }
+};
+
+// Writes an RGB image; the format follows the file extension.
+// main() turns on vertical flipping once, since images are stored bottom row first.
+bool writeImage(const char* filename, int width, int height, const uint8_t* data) {
+    const char* ext = strrchr(filename, '.');
+    if (ext && !strcmp(ext, ".bmp")) return stbi_write_bmp(filename, width, height, 3, data) != 0;
+    if (ext && !strcmp(ext, ".tga")) return stbi_write_tga(filename, width, height, 3, data) != 0;
+    if (ext && (!strcmp(ext, ".jpg") || !strcmp(ext, ".jpeg"))) return stbi_write_jpg(filename, width, height, 3, data, 95) != 0;
+    return stbi_write_png(filename, width, height, 3, data, width * 3) != 0;
+}
+
+// Encodes and writes frames on background threads so the renderer never waits on
+// deflate or disk I/O. Frames are rendered straight into buffers taken from a fixed
+// recycled pool; once every buffer is queued or being encoded, acquire() blocks,
+// which is the backpressure that keeps memory bounded.
+class FrameWriter {
+public:
+    FrameWriter(int encoderCount, int queueDepth);
+    ~FrameWriter();
+    // Returns a free buffer of at least size bytes, waiting while all buffers are in flight
+    std::vector<uint8_t>* acquire(size_t size);
+    // Queues a buffer from acquire() for writing; the writer recycles it afterwards
+    void submit(std::vector<uint8_t>* buffer, const std::string& filename, int width, int height);
+    // Waits until every queued frame has been written
+    void flush();
+    int failures() const { return failed; }
+
+private:
+    struct Job {
+        std::vector<uint8_t>* buffer;
+        std::string filename;
+        int width, height;
+    };
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> buffers;
+    std::vector<std::vector<uint8_t>*> freeBuffers;
+    std::deque<Job> jobs;
+    std::vector<std::thread> encoders;
+    std::mutex m;
+    std::condition_variable jobCv, freeCv;
+    int pending = 0;
+    int failed = 0;
+    bool stopping = false;
+
+    void encodeLoop();
+};
+
+FrameWriter::FrameWriter(int encoderCount, int queueDepth) {
+    encoderCount = std::max(1, encoderCount);
+    queueDepth = std::max(1, queueDepth);
+    // One buffer per queue slot plus one per encoder covers everything that can be in flight
+    for (int i = 0; i < queueDepth + encoderCount; ++i) {
+        buffers.push_back(std::make_unique<std::vector<uint8_t>>());
+        freeBuffers.push_back(buffers.back().get());
+    }
+    for (int i = 0; i < encoderCount; ++i) encoders.emplace_back(&FrameWriter::encodeLoop, this);
+}
+
+FrameWriter::~FrameWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    jobCv.notify_all();
+    for (auto& t : encoders) t.join();
+}
+
+std::vector<uint8_t>* FrameWriter::acquire(size_t size) {
+    std::unique_lock<std::mutex> lock(m);
+    freeCv.wait(lock, [this] { return !freeBuffers.empty(); });
+    std::vector<uint8_t>* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    lock.unlock();
+    buffer->resize(size);
+    return buffer;
+}
+
+void FrameWriter::submit(std::vector<uint8_t>* buffer, const std::string& filename, int width, int height) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        jobs.push_back({buffer, filename, width, height});
+        pending++;
+    }
+    jobCv.notify_one();
+}
+
+void FrameWriter::flush() {
+    std::unique_lock<std::mutex> lock(m);
+    freeCv.wait(lock, [this] { return pending == 0; });
+}
+
+void FrameWriter::encodeLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            jobCv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        bool ok = writeImage(job.filename.c_str(), job.width, job.height, job.buffer->data());
+        if (!ok) std::cerr << "Failed to write " << job.filename << "\n";
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (!ok) failed++;
+            freeBuffers.push_back(job.buffer);
+            pending--;
+        }
+        freeCv.notify_all();
+    }
+}
+
+// Deflate (RFC 1951) in a zlib wrapper, compressed as the data arrives so an image never
+// has to be held whole. Everything goes into one block with the fixed Huffman codes;
+// LZ77 matches are found through hash chains over a 32 KB history that carries over from
+// one write() to the next. stb's encoder needs the whole image in memory, so streamed PNG
+// output uses this instead.
+class DeflateStream {
+public:
+    DeflateStream() : head(size_t(1) << HASH_BITS, -1), prev(WINDOW, -1) {}
+    // Appends the compressed form of data to out; bits of the last byte may stay pending
+    void write(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+    // Ends the stream: end-of-block code, padding and the Adler-32 of everything written
+    void finish(std::vector<uint8_t>& out);
+
+private:
+    static const int WINDOW = 32768, HASH_BITS = 15, MAX_CHAIN = 32, MIN_MATCH = 3, MAX_MATCH = 258;
+    std::vector<uint8_t> history; // the last WINDOW bytes before the current write, then its data
+    int64_t historyStart = 0;     // stream position of history[0]
+    std::vector<int64_t> head, prev; // newest position per hash, and the one before it per position
+    uint64_t bits = 0;
+    int bitCount = 0;
+    uint32_t adlerA = 1, adlerB = 0;
+    bool started = false;
+
+    void put(uint32_t value, int count, std::vector<uint8_t>& out);
+    void putCode(uint32_t code, int length, std::vector<uint8_t>& out); // Huffman codes go MSB first
+    void putLiteral(int symbol, std::vector<uint8_t>& out);
+    void putMatch(int length, int distance, std::vector<uint8_t>& out);
+};
+
+void DeflateStream::put(uint32_t value, int count, std::vector<uint8_t>& out) {
+    bits |= uint64_t(value) << bitCount;
+    bitCount += count;
+    for (; bitCount >= 8; bitCount -= 8, bits >>= 8) out.push_back(uint8_t(bits));
+}
+
+void DeflateStream::putCode(uint32_t code, int length, std::vector<uint8_t>& out) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) reversed |= ((code >> i) & 1) << (length - 1 - i);
+    put(reversed, length, out);
+}
+
+void DeflateStream::putLiteral(int symbol, std::vector<uint8_t>& out) {
+    if (symbol < 144) putCode(0x30 + symbol, 8, out);
+    else if (symbol < 256) putCode(0x190 + symbol - 144, 9, out);
+    else if (symbol < 280) putCode(symbol - 256, 7, out);
+    else putCode(0xC0 + symbol - 280, 8, out);
+}
+
+void DeflateStream::putMatch(int length, int distance, std::vector<uint8_t>& out) {
+    static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                       35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                     257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int l = int(std::upper_bound(lengthBase, lengthBase + 29, length) - lengthBase) - 1;
+    putLiteral(257 + l, out);
+    put(length - lengthBase[l], lengthExtra[l], out);
+    int d = int(std::upper_bound(distBase, distBase + 30, distance) - distBase) - 1;
+    putCode(d, 5, out);
+    put(distance - distBase[d], distExtra[d], out);
+}
+
+void DeflateStream::write(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    if (!started) {
+        out.push_back(0x78); out.push_back(0x5E); // zlib header: deflate, 32 KB window
+        put(1, 1, out); // BFINAL: the only block
+        put(1, 2, out); // BTYPE: fixed Huffman codes
+        started = true;
+    }
+    // Adler-32, folded before the sums can overflow
+    for (size_t i = 0; i < size;) {
+        size_t n = std::min<size_t>(size - i, 5552);
+        for (size_t end = i + n; i < end; ++i) {
+            adlerA += data[i];
+            adlerB += adlerA;
+        }
+        adlerA %= 65521; adlerB %= 65521;
+    }
+
+    // Keep the window the matches may reach back into, then append the new data
+    if (history.size() > size_t(WINDOW)) {
+        size_t drop = history.size() - WINDOW;
+        history.erase(history.begin(), history.begin() + drop);
+        historyStart += int64_t(drop);
+    }
+    size_t begin = history.size();
+    history.insert(history.end(), data, data + size);
+    const uint8_t* h = history.data();
+    const size_t end = history.size();
+    auto hashAt = [h](size_t i) { return ((uint32_t(h[i]) << 10) ^ (uint32_t(h[i + 1]) << 5) ^ h[i + 2]) & ((1u << HASH_BITS) - 1); };
+    auto insert = [&](size_t i) {
+        if (i + MIN_MATCH > end) return;
+        int64_t pos = historyStart + int64_t(i);
+        uint32_t hash = hashAt(i);
+        prev[pos & (WINDOW - 1)] = head[hash];
+        head[hash] = pos;
+    };
+
+    for (size_t i = begin; i < end;) {
+        int bestLength = 0, bestDistance = 0;
+        if (i + MIN_MATCH <= end) {
+            int64_t pos = historyStart + int64_t(i);
+            int64_t candidate = head[hashAt(i)];
+            int maxLength = (int)std::min<size_t>(MAX_MATCH, end - i);
+            // Positions in the chain stay valid while they are less than WINDOW back
+            for (int chain = 0; candidate >= 0 && pos - candidate < WINDOW && chain < MAX_CHAIN; ++chain) {
+                const uint8_t* a = h + i;
+                const uint8_t* b = h + (candidate - historyStart);
+                if (b[bestLength] == a[bestLength]) {
+                    int length = 0;
+                    while (length < maxLength && a[length] == b[length]) ++length;
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = int(pos - candidate);
+                        if (length == maxLength) break;
+                    }
+                }
+                int64_t next = prev[candidate & (WINDOW - 1)];
+                if (next >= candidate) break;
+                candidate = next;
+            }
+        }
+        if (bestLength >= MIN_MATCH) {
+            putMatch(bestLength, bestDistance, out);
+            for (int k = 0; k < bestLength; ++k) insert(i + k);
+            i += bestLength;
+        } else {
+            putLiteral(h[i], out);
+            insert(i);
+            ++i;
+        }
+    }
+}
+
+void DeflateStream::finish(std::vector<uint8_t>& out) {
+    if (!started) write(nullptr, 0, out);
+    putLiteral(256, out);
+    if (bitCount > 0) put(0, 8 - bitCount, out);
+    uint32_t adler = (adlerB << 16) | adlerA;
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(adler >> shift));
+}
+
+// Writes an image band by band, for outputs too large to hold in memory. Bands hold rows
+// bottom row first like the renderer's images. PNG stores the top row first, so its bands
+// have to arrive top band first; BMP and TGA store the bottom row first and take bands
+// bottom first, which topDown() tells apart. JPEG is not supported.
+class StreamingImageWriter {
+public:
+    bool open(const std::string& filename, int width, int height, std::string& error);
+    bool topDown() const { return format == PNG; }
+    bool writeBand(const uint8_t* rows, int count);
+    bool finish();
+
+private:
+    enum Format { PNG, BMP, TGA } format = PNG;
+    std::ofstream file;
+    int width = 0, height = 0;
+    size_t rowBytes = 0;
+    // PNG: the previous row for the filters, and filtered rows before deflate
+    std::vector<uint8_t> previousRow, filtered, compressed;
+    DeflateStream deflate;
+    std::vector<uint8_t> padded; // BMP and TGA: rows as BGR
+
+    void writeChunk(const char* type, const uint8_t* data, size_t size);
+};
+
+// CRC-32 as PNG chunks use it
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void StreamingImageWriter::writeChunk(const char* type, const uint8_t* data, size_t size) {
+    uint8_t header[8] = {uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+                         uint8_t(type[0]), uint8_t(type[1]), uint8_t(type[2]), uint8_t(type[3])};
+    uint32_t crc = crc32(crc32(0, header + 4, 4), data, size);
+    uint8_t trailer[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc)};
+    file.write(reinterpret_cast<const char*>(header), 8);
+    file.write(reinterpret_cast<const char*>(data), std::streamsize(size));
+    file.write(reinterpret_cast<const char*>(trailer), 4);
+}
+
+bool StreamingImageWriter::open(const std::string& filename, int width, int height, std::string& error) {
+    this->width = width;
+    this->height = height;
+    rowBytes = size_t(width) * 3;
+    size_t dot = filename.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : filename.substr(dot);
+    if (ext == ".jpg" || ext == ".jpeg") {
+        error = "tiled output writes png, bmp or tga, not jpeg"; return false;
+    }
+    format = ext == ".bmp" ? BMP : ext == ".tga" ? TGA : PNG;
+    size_t bmpRow = (rowBytes + 3) & ~size_t(3);
+    if (format == BMP && 54 + uint64_t(bmpRow) * height > 0xFFFFFFFFull) {
+        error = "image is too large for bmp, which is limited to 4 GB"; return false;
+    }
+    if (format == TGA && (width > 65535 || height > 65535)) {
+        error = "tga is limited to 65535 pixels per side"; return false;
+    }
+    file.open(filename, std::ios::binary);
+    if (!file) {
+        error = "cannot write " + filename; return false;
+    }
+
+    auto le32 = [](uint8_t* p, uint32_t v) { p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); p[2] = uint8_t(v >> 16); p[3] = uint8_t(v >> 24); };
+    if (format == PNG) {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        file.write(reinterpret_cast<const char*>(signature), 8);
+        uint8_t ihdr[13] = {uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+                            uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+                            8, 2, 0, 0, 0}; // 8-bit RGB, deflate, adaptive filters, no interlace
+        writeChunk("IHDR", ihdr, sizeof(ihdr));
+        previousRow.assign(rowBytes, 0);
+    } else if (format == BMP) {
+        uint8_t header[54] = {'B', 'M'};
+        le32(header + 2, uint32_t(54 + uint64_t(bmpRow) * height));
+        le32(header + 10, 54);
+        le32(header + 14, 40);
+        le32(header + 18, uint32_t(width));
+        le32(header + 22, uint32_t(height)); // positive height: bottom row first
+        header[26] = 1;
+        header[28] = 24;
+        le32(header + 34, uint32_t(uint64_t(bmpRow) * height));
+        file.write(reinterpret_cast<const char*>(header), 54);
+        padded.assign(bmpRow, 0);
+    } else {
+        uint8_t header[18] = {0, 0, 2}; // uncompressed true colour, bottom-left origin
+        header[12] = uint8_t(width); header[13] = uint8_t(width >> 8);
+        header[14] = uint8_t(height); header[15] = uint8_t(height >> 8);
+        header[16] = 24;
+        file.write(reinterpret_cast<const char*>(header), 18);
+        padded.assign(rowBytes, 0);
+    }
+    return bool(file);
+}
+
+bool StreamingImageWriter::writeBand(const uint8_t* rows, int count) {
+    if (format != PNG) {
+        for (int r = 0; r < count; ++r) {
+            const uint8_t* row = rows + size_t(r) * rowBytes;
+            for (size_t x = 0; x < rowBytes; x += 3) {
+                padded[x] = row[x + 2]; padded[x + 1] = row[x + 1]; padded[x + 2] = row[x];
+            }
+            file.write(reinterpret_cast<const char*>(padded.data()), std::streamsize(padded.size()));
+        }
+        return bool(file);
+    }
+
+    // Each row gets the filter with the smallest sum of absolute residuals, as stb does
+    filtered.resize(size_t(count) * (rowBytes + 1));
+    std::vector<uint8_t> candidate(rowBytes);
+    for (int r = 0; r < count; ++r) {
+        const uint8_t* row = rows + size_t(count - 1 - r) * rowBytes;
+        const uint8_t* up = previousRow.data();
+        uint8_t* dst = filtered.data() + size_t(r) * (rowBytes + 1);
+        uint64_t bestSum = ~uint64_t(0);
+        for (int type = 0; type < 5; ++type) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < rowBytes; ++i) {
+                int a = i >= 3 ? row[i - 3] : 0, b = up[i], c = i >= 3 ? up[i - 3] : 0, predictor = 0;
+                if (type == 1) predictor = a;
+                else if (type == 2) predictor = b;
+                else if (type == 3) predictor = (a + b) >> 1;
+                else if (type == 4) {
+                    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                    predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                }
+                candidate[i] = uint8_t(row[i] - predictor);
+                sum += std::abs(int(int8_t(candidate[i])));
+            }
+            if (sum < bestSum) {
+                bestSum = sum;
+                dst[0] = uint8_t(type);
+                std::copy(candidate.begin(), candidate.end(), dst + 1);
+            }
+        }
+        std::copy(row, row + rowBytes, previousRow.begin());
+    }
+    compressed.clear();
+    deflate.write(filtered.data(), filtered.size(), compressed);
+    if (!compressed.empty()) writeChunk("IDAT", compressed.data(), compressed.size());
+    return bool(file);
+}
+
+bool StreamingImageWriter::finish() {
+    if (format == PNG) {
+        compressed.clear();
+        deflate.finish(compressed);
+        writeChunk("IDAT", compressed.data(), compressed.size());
+        writeChunk("IEND", nullptr, 0);
+    }
+    file.close();
+    return bool(file);
+}
+
+// Fills a printf-style frame pattern such as frames/frame_%04d.png
+std::string frameFilename(const char* pattern, int frame) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), pattern, frame);
+    return filename;
+}
+
+void printBVHStats(const World& world, const RayStats& stats, double updateMs) {
+    double rays = double(std::max<uint64_t>(stats.rays, 1));
+    std::cout << (useBVH ? "BVH" : "Linear") << ": " << world.bvh.staticBVH.nodes.size() << " static + "
+              << world.bvh.dynamicBVH.nodes.size() << " dynamic nodes, refit "
+              << updateMs << " ms";
+    if (!RT2_STATS) return;
+    std::cout << ", "
+              << stats.nodesVisited / rays << " nodes/ray, "
+              << (useBVH ? stats.totalPrimTests() / rays : double(world.spheres.size() + world.scene.triangleCount())) << " prim tests/ray, "
+              << 100.0 * stats.occluderCacheHits / double(std::max<uint64_t>(stats.shadowRays, 1)) << "% shadow rays stopped by cached occluder";
+}
+
+// Anti-aliasing cost: rays per pixel against the budget and the share of pixels refined
+void printSampleBudget(const RayStats& stats, uint64_t pixels, int maxSamples) {
+    if (!RT2_STATS) return;
+    pixels = std::max<uint64_t>(pixels, 1);
+    std::cout << ", " << double(stats.primaryRays) / pixels << " samples/pixel (budget " << maxSamples << "), "
+              << 100.0 * stats.supersampledPixels / pixels << "% of pixels supersampled";
+}
+
+// One frame's counters as a single JSON line, for the --stats dump
+void writeFrameStats(std::ostream& out, int frame, double ms, const RayStats& s) {
+    out << "{\"frame\": " << frame << ", \"ms\": " << ms
+        << ", \"primary\": " << s.primaryRays << ", \"shadow\": " << s.shadowRays
+        << ", \"reflection\": " << s.reflectionRays << ", \"hits\": " << s.hits
+        << ", \"sphere_tests\": " << s.primTests[PRIM_SPHERE] << ", \"triangle_tests\": " << s.primTests[PRIM_TRIANGLE]
+        << ", \"instance_tests\": " << s.primTests[PRIM_INSTANCE]
+        << ", \"nodes\": " << s.nodesVisited << ", \"occluder_cache_hits\": " << s.occluderCacheHits
+        << ", \"max_depth\": " << s.maxDepth << ", \"reused\": " << s.reusedPixels
+        << ", \"supersampled\": " << s.supersampledPixels << "}\n";
+}
+
+struct Options {
+    int threadCount = (int)std::thread::hardware_concurrency();
+    const char* simdMode = "auto";
+    int width = 600, height = 600;
+    // Offline mode renders a fixed number of frames with a fixed timestep and no window
+    int offlineFrames = 0;
+    int firstFrame = 0; // number of the first offline frame; its time is firstFrame * timestep
+    float timestep = 1.f / 30.f;
+    const char* outPattern = "frames/frame_%04d.png";
+    // Windowed mode writes every displayed frame when a pattern is given
+    const char* dumpPattern = nullptr;
+    int encoderThreads = 2;
+    int writeQueueDepth = 4;
+    // Per-frame counters are written here, one JSON line per frame
+    const char* statsPath = nullptr;
+    // Windowed mode lowers the internal resolution to hold this frame time (ms), 0 = off
+    float targetFrameMs = 0.f;
+    // Reuse last frame's shading through the reprojection cache
+    bool reproject = false;
+    // Retrace only what moving spheres changed while the camera holds still
+    bool incremental = false;
+    // Camera orbit speed in radians per second
+    float orbitSpeed = 0.5f;
+    // Refine the image over several frames, each with this budget (ms), 0 = off
+    float progressiveMs = 0.f;
+    // Passes each offline frame adds in progressive mode, in place of the time budget
+    int progressivePasses = 1;
+    // Most rays per pixel for adaptive anti-aliasing (4, 16, 36 or 64), 0 = off
+    int aaSamples = 0;
+    // Benchmark mode renders the named scenes and writes a JSON report
+    const char* benchScenes = nullptr;
+    int benchFrames = 30;
+    const char* benchOut = "benchmark.json";
+    // Compares fast-math shading with the precise path on these scenes, then exits
+    const char* fastMathCheck = nullptr;
+    // Runs the render service on this Unix socket
+    const char* servePath = nullptr;
+    // Render farm: offline frames are split over this many worker processes, each frame
+    // optionally cut into farmBands row bands. farmDir holds the checkpoint and job state.
+    int farmWorkers = 0;
+    int farmBands = 1;
+    std::string farmDir;
+    bool farmWorker = false; // this process is one of the workers
+    // Offline frames are traced and written one tile row at a time instead of whole
+    bool tiledOutput = false;
+    // OBJ mesh that takes the tetrahedron's place
+    const char* objPath = nullptr;
+    // More than one: the OBJ mesh is instanced this many times in a grid over the floor
+    int objCopies = 1;
+};
+
+// Offline mode: no window or GL context, time advances by a fixed step per frame
+int runOffline(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels, World& world) {
+    const size_t imageSize = size_t(opt.width) * opt.height * 3;
+    std::vector<uint8_t> scratch(imageSize);
+    bool writeFrames = strcmp(opt.outPattern, "none") != 0;
+    FrameWriter writer(opt.encoderThreads, opt.writeQueueDepth);
+    double totalMs = 0.0, totalUpdateMs = 0.0;
+    RayStats totalStats;
+    ReprojectionCache cache;
+    DirtyRegionCache dirtyCache;
+    ProgressiveRenderer progressive;
+    std::ofstream statsFile;
+    if (opt.statsPath) statsFile.open(opt.statsPath);
+
+    for (int frame = opt.firstFrame; frame < opt.firstFrame + opt.offlineFrames; ++frame) {
+        auto start = std::chrono::high_resolution_clock::now();
+        float time = frame * opt.timestep;
+        float angle = time * opt.orbitSpeed; // rotation
+        animateWorld(world, animating ? time : 0.f);
+        totalUpdateMs += world.bvh.updateMs;
+        Camera cam = orbitCamera(angle, float(opt.width) / float(opt.height), isPerspective);
+        std::vector<uint8_t>* image = writeFrames ? writer.acquire(imageSize) : &scratch;
+        RayStats frameStats;
+        // Offline frames take a fixed number of passes, not a time budget, so runs repeat
+        if (opt.progressiveMs > 0.f) progressive.render(scheduler, packetKernels, world, cam, opt.width, opt.height, 0.0, opt.progressivePasses, image->data(), frameStats);
+        else if (opt.incremental) renderFrameIncremental(scheduler, packetKernels, world, cam, opt.width, opt.height, image->data(), frameStats, dirtyCache);
+        else if (opt.reproject) renderFrameCached(scheduler, packetKernels, world, cam, opt.width, opt.height, image->data(), frameStats, cache);
+        else if (opt.aaSamples > 0) renderFrameAA(scheduler, packetKernels, world, cam, opt.width, opt.height, opt.aaSamples, image->data(), frameStats);
+        else renderFrame(scheduler, packetKernels, world, cam, opt.width, opt.height, image->data(), frameStats);
+        std::string filename;
+        if (writeFrames) {
+            filename = frameFilename(opt.outPattern, frame);
+            writer.submit(image, filename, opt.width, opt.height);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        totalMs += ms;
+        totalStats += frameStats;
+        if (statsFile.is_open()) writeFrameStats(statsFile, frame, ms, frameStats);
+
+        std::cout << "Frame " << frame << ": " << ms << " ms";
+        if (opt.progressiveMs > 0.f) std::cout << ", " << progressive.passesDone() << " passes";
+        if (writeFrames) std::cout << " -> " << filename;
+        std::cout << std::endl;
+    }
+    writer.flush();
+    if (writer.failures() > 0) {
+        std::cerr << writer.failures() << " frame(s) could not be written\n"; return -1;
+    }
+
+    if (opt.offlineFrames > 0) {
+        std::cout << opt.offlineFrames << " frames at " << opt.width << "x" << opt.height << ", "
+                  << totalMs / opt.offlineFrames << " ms/frame. ";
+        printBVHStats(world, totalStats, totalUpdateMs / opt.offlineFrames);
+        if (opt.aaSamples > 0) printSampleBudget(totalStats, uint64_t(opt.width) * opt.height * opt.offlineFrames, opt.aaSamples);
+        std::cout << std::endl;
+    }
+    return 0;
+}
+
+// Runs one job at a time on its own thread. The windowed loop renders on it so the GL
+// thread can present the previous frame meanwhile, and the job's thread then joins the
+// TileScheduler as worker 0; tiled output encodes one band on it while the next traces.
+class RenderThread {
+public:
+    RenderThread() { thread = std::thread(&RenderThread::loop, this); }
+    ~RenderThread();
+    void start(std::function<void()> fn);
+    void wait();
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::function<void()> job;
+    bool busy = false, quit = false;
+    std::thread thread;
+    void loop();
+};
+
+RenderThread::~RenderThread() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void RenderThread::start(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        job = std::move(fn);
+        busy = true;
+    }
+    cv.notify_all();
+}
+
+void RenderThread::wait() {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return !busy; });
+}
+
+void RenderThread::loop() {
+    std::unique_lock<std::mutex> lock(m);
+    for (;;) {
+        cv.wait(lock, [&] { return busy || quit; });
+        if (!busy) return;
+        lock.unlock();
+        job();
+        lock.lock();
+        busy = false;
+        cv.notify_all();
+    }
+}
+
+// Tiled offline output for images too large to hold in memory. Each frame is traced one
+// tile row at a time into a band buffer, and every finished band is encoded and written
+// on the encoder thread while the next one traces, so memory stays at two bands however
+// large the output is.
+int runOfflineTiled(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels, World& world) {
+    const int width = opt.width, height = opt.height;
+    const int tilesX = (width + RENDER_TILE - 1) / RENDER_TILE, tileRows = (height + RENDER_TILE - 1) / RENDER_TILE;
+    const size_t bandSize = size_t(width) * RENDER_TILE * 3;
+    std::vector<uint8_t> bands[2] = {std::vector<uint8_t>(bandSize), std::vector<uint8_t>(bandSize)};
+    std::vector<int> tiles(tilesX);
+    bool writeFrames = strcmp(opt.outPattern, "none") != 0;
+    RenderThread encoder;
+    double totalMs = 0.0, totalUpdateMs = 0.0;
+    RayStats totalStats;
+    std::ofstream statsFile;
+    if (opt.statsPath) statsFile.open(opt.statsPath);
+
+    for (int frame = opt.firstFrame; frame < opt.firstFrame + opt.offlineFrames; ++frame) {
+        auto start = std::chrono::high_resolution_clock::now();
+        float time = frame * opt.timestep;
+        animateWorld(world, animating ? time : 0.f);
+        totalUpdateMs += world.bvh.updateMs;
+        Camera cam = orbitCamera(time * opt.orbitSpeed, float(width) / float(height), isPerspective);
+        StreamingImageWriter writer;
+        std::string filename, error;
+        if (writeFrames) {
+            filename = frameFilename(opt.outPattern, frame);
+            if (!writer.open(filename, width, height, error)) {
+                std::cerr << "Frame " << frame << ": " << error << "\n"; return -1;
+            }
+        }
+
+        RayStats frameStats;
+        bool written = true;
+        for (int k = 0; k < tileRows; ++k) {
+            int ty = writeFrames && writer.topDown() ? tileRows - 1 - k : k;
+            int y0 = ty * RENDER_TILE, rows = std::min(RENDER_TILE, height - y0);
+            for (int tx = 0; tx < tilesX; ++tx) tiles[tx] = ty * tilesX + tx;
+            // The encoder is done with this buffer: it was handed band k - 2, and band k - 1
+            // was only queued after waiting for it
+            uint8_t* band = bands[k % 2].data();
+            renderFrame(scheduler, packetKernels, world, cam, width, height, band, frameStats, &tiles, y0);
+            if (writeFrames) {
+                encoder.wait();
+                encoder.start([&writer, &written, band, rows] { written = writer.writeBand(band, rows) && written; });
+            }
+        }
+        encoder.wait();
+        if (writeFrames && !(writer.finish() && written)) {
+            std::cerr << "Failed to write " << filename << "\n"; return -1;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        totalMs += ms;
+        totalStats += frameStats;
+        if (statsFile.is_open()) writeFrameStats(statsFile, frame, ms, frameStats);
+
+        std::cout << "Frame " << frame << ": " << ms << " ms";
+        if (writeFrames) std::cout << " -> " << filename;
+        std::cout << std::endl;
+    }
+
+    if (opt.offlineFrames > 0) {
+        std::cout << opt.offlineFrames << " frames at " << width << "x" << height << " in bands of "
+                  << RENDER_TILE << " rows (" << 2 * bandSize / 1024 << " KB of band buffers), "
+                  << totalMs / opt.offlineFrames << " ms/frame. ";
+        printBVHStats(world, totalStats, totalUpdateMs / opt.offlineFrames);
+        std::cout << std::endl;
+    }
+    return 0;
+}
+
+// Render farm. The coordinator (--farm N) starts N copies of this program with the same
+// options plus --farm-worker. A job is one frame, or one row band of a frame with
+// --farm-tiles. Workers claim jobs by creating a directory per job under the farm
+// directory, which succeeds for exactly one process, so faster workers simply take more
+// jobs. A worker writes a whole frame straight to its output file, or a band as raw rows
+// for the coordinator to assemble, and then reports "done FRAME BAND" on stdout. The
+// coordinator appends every finished band and frame to checkpoint.txt, so a run that was
+// interrupted resumes with the frames still missing when the same command is run again.
+namespace fs = std::filesystem;
+
+// Rows [y0, y1) of a band; bands are cut at tile rows so no tile is traced twice
+void farmBandRows(const Options& opt, int band, int& y0, int& y1) {
+    int tileRows = (opt.height + RENDER_TILE - 1) / RENDER_TILE;
+    y0 = std::min(opt.height, tileRows * band / opt.farmBands * RENDER_TILE);
+    y1 = std::min(opt.height, tileRows * (band + 1) / opt.farmBands * RENDER_TILE);
+}
+
+fs::path farmBandFile(const Options& opt, int frame, int band) {
+    return fs::path(opt.farmDir) / ("band_" + std::to_string(frame) + "_" + std::to_string(band) + ".raw");
+}
+
+fs::path farmClaim(const Options& opt, int frame, int band) {
+    return fs::path(opt.farmDir) / "claims" / (std::to_string(frame) + "_" + std::to_string(band));
+}
+
+int runFarmWorker(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels, World& world) {
+    const int width = opt.width, height = opt.height;
+    const int tilesX = (width + RENDER_TILE - 1) / RENDER_TILE;
+    std::vector<uint8_t> image(size_t(width) * height * 3);
+
+    for (int frame = opt.firstFrame; frame < opt.firstFrame + opt.offlineFrames; ++frame) {
+        for (int band = 0; band < opt.farmBands; ++band) {
+            std::error_code ec;
+            if (!fs::create_directory(farmClaim(opt, frame, band), ec)) continue; // taken, or done before
+
+            float time = frame * opt.timestep;
+            animateWorld(world, animating ? time : 0.f);
+            Camera cam = orbitCamera(time * opt.orbitSpeed, float(width) / float(height), isPerspective);
+            RayStats stats;
+            bool written;
+            if (opt.farmBands == 1) {
+                if (opt.aaSamples > 0) renderFrameAA(scheduler, packetKernels, world, cam, width, height, opt.aaSamples, image.data(), stats);
+                else renderFrame(scheduler, packetKernels, world, cam, width, height, image.data(), stats);
+                written = writeImage(frameFilename(opt.outPattern, frame).c_str(), width, height, image.data());
+            } else {
+                int y0, y1;
+                farmBandRows(opt, band, y0, y1);
+                std::vector<int> tiles;
+                for (int ty = y0 / RENDER_TILE; ty * RENDER_TILE < y1; ++ty)
+                    for (int tx = 0; tx < tilesX; ++tx) tiles.push_back(ty * tilesX + tx);
+                renderFrame(scheduler, packetKernels, world, cam, width, height, image.data(), stats, &tiles);
+                std::ofstream raw(farmBandFile(opt, frame, band), std::ios::binary);
+                raw.write(reinterpret_cast<const char*>(image.data()) + size_t(y0) * width * 3, std::streamsize(size_t(y1 - y0) * width * 3));
+                raw.close();
+                written = bool(raw);
+            }
+            if (!written) {
+                std::cerr << "Cannot write frame " << frame << " band " << band << "\n"; return -1;
+            }
+            std::cout << "done " << frame << " " << band << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Quotes one argument for the shell popen() runs
+std::string shellQuote(const std::string& arg) {
+#ifdef _WIN32
+    return "\"" + arg + "\"";
+#else
+    std::string quoted = "'";
+    for (char c : arg) quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return quoted + "'";
+#endif
+}
+
+int runFarm(const Options& opt, int argc, char** argv) {
+    const int first = opt.firstFrame, last = opt.firstFrame + opt.offlineFrames;
+    const fs::path dir = opt.farmDir;
+    const fs::path checkpointPath = dir / "checkpoint.txt";
+
+    // Worker command line: this program with the same options, minus the farm size and
+    // thread count. It doubles as the job signature kept in the checkpoint.
+    std::string job;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--farm") || !strcmp(argv[i], "--threads") || !strcmp(argv[i], "-t")) { ++i; continue; }
+        job += " " + shellQuote(argv[i]);
+    }
+
+    std::error_code ec;
+    fs::remove_all(dir / "claims", ec); // claims of an interrupted run
+    fs::create_directories(dir / "claims", ec);
+    if (ec) {
+        std::cerr << "Cannot create " << (dir / "claims").string() << ": " << ec.message() << "\n"; return -1;
+    }
+
+    // Resume from the checkpoint if it was written for the same job. Frames whose file
+    // has gone missing since are rendered again.
+    std::set<int> doneFrames;
+    std::map<int, std::set<int>> doneBands;
+    {
+        std::ifstream in(checkpointPath);
+        std::string line;
+        if (std::getline(in, line) && line == "job" + job) {
+            while (std::getline(in, line)) {
+                int frame, band;
+                if (sscanf(line.c_str(), "band %d %d", &frame, &band) == 2 && fs::exists(farmBandFile(opt, frame, band)))
+                    doneBands[frame].insert(band);
+                else if (sscanf(line.c_str(), "frame %d", &frame) == 1 && fs::exists(frameFilename(opt.outPattern, frame)))
+                    doneFrames.insert(frame);
+            }
+        } else if (in.is_open()) {
+            std::cout << "Checkpoint in " << dir.string() << " is for other options, starting over." << std::endl;
+        }
+    }
+    std::ofstream checkpoint(checkpointPath, std::ios::trunc);
+    checkpoint << "job" << job << "\n";
+    for (int frame : doneFrames) checkpoint << "frame " << frame << "\n";
+    for (const auto& bands : doneBands)
+        for (int band : bands.second) if (!doneFrames.count(bands.first)) checkpoint << "band " << bands.first << " " << band << "\n";
+    checkpoint.flush();
+    if (!checkpoint) {
+        std::cerr << "Cannot write " << checkpointPath.string() << "\n"; return -1;
+    }
+
+    // Puts a frame's bands together and writes it; called with every band done
+    std::vector<uint8_t> image;
+    auto assemble = [&](int frame) {
+        image.resize(size_t(opt.width) * opt.height * 3);
+        bool ok = true;
+        for (int band = 0; band < opt.farmBands; ++band) {
+            int y0, y1;
+            farmBandRows(opt, band, y0, y1);
+            std::ifstream raw(farmBandFile(opt, frame, band), std::ios::binary);
+            ok = ok && raw.read(reinterpret_cast<char*>(image.data()) + size_t(y0) * opt.width * 3, std::streamsize(size_t(y1 - y0) * opt.width * 3));
+        }
+        ok = ok && writeImage(frameFilename(opt.outPattern, frame).c_str(), opt.width, opt.height, image.data());
+        if (!ok) {
+            std::cerr << "Cannot assemble frame " << frame << "\n"; return;
+        }
+        for (int band = 0; band < opt.farmBands; ++band) fs::remove(farmBandFile(opt, frame, band), ec);
+        doneFrames.insert(frame);
+        doneBands.erase(frame);
+        checkpoint << "frame " << frame << "\n";
+    };
+
+    // Jobs already done are claimed up front, so no worker picks them up
+    int pendingJobs = 0;
+    for (int frame = first; frame < last; ++frame) {
+        if (!doneFrames.count(frame) && (int)doneBands[frame].size() == opt.farmBands) assemble(frame);
+        for (int band = 0; band < opt.farmBands; ++band) {
+            if (doneFrames.count(frame) || doneBands[frame].count(band)) fs::create_directory(farmClaim(opt, frame, band), ec);
+            else pendingJobs++;
+        }
+    }
+    checkpoint.flush();
+    int resumed = (int)doneFrames.size();
+    if (resumed > 0) std::cout << "Resuming: " << resumed << " of " << opt.offlineFrames << " frames already done." << std::endl;
+    if (pendingJobs == 0) {
+        std::cout << "All frames are done." << std::endl;
+        return 0;
+    }
+
+    const int workers = std::min(opt.farmWorkers, pendingJobs);
+    const int threadsPerWorker = std::max(1, opt.threadCount / workers);
+    std::string command = shellQuote(argv[0]) + job + " --farm-worker " + shellQuote(opt.farmDir) +
+                          " --threads " + std::to_string(threadsPerWorker);
+#ifdef _WIN32
+    command = "\"" + command + "\""; // cmd /c strips one pair of outer quotes
+#endif
+    std::cout << "Farming " << pendingJobs << " job(s) of frames " << first << "-" << last - 1 << " out to " << workers
+              << " worker(s) with " << threadsPerWorker << " thread(s) each." << std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::mutex m;
+    int failedWorkers = 0;
+    std::vector<std::thread> readers;
+    for (int w = 0; w < workers; ++w) {
+        FILE* pipe = popen(command.c_str(), "r");
+        if (!pipe) {
+            std::cerr << "Cannot start worker " << w << "\n";
+            failedWorkers++;
+            continue;
+        }
+        readers.emplace_back([&, w, pipe] {
+            char line[512];
+            while (fgets(line, sizeof(line), pipe)) {
+                std::lock_guard<std::mutex> lock(m);
+                int frame, band;
+                if (sscanf(line, "done %d %d", &frame, &band) != 2) {
+                    std::cout << "[worker " << w << "] " << line << std::flush; // worker's own output
+                    continue;
+                }
+                if (opt.farmBands == 1) {
+                    doneFrames.insert(frame);
+                    checkpoint << "frame " << frame << "\n";
+                } else {
+                    doneBands[frame].insert(band);
+                    checkpoint << "band " << frame << " " << band << "\n";
+                    if ((int)doneBands[frame].size() == opt.farmBands) assemble(frame);
+                }
+                checkpoint.flush();
+                if (doneFrames.count(frame))
+                    std::cout << "Frame " << frame << " done by worker " << w << " (" << doneFrames.size() << "/" << opt.offlineFrames << ")" << std::endl;
+            }
+            int status = pclose(pipe);
+            std::lock_guard<std::mutex> lock(m);
+            if (status != 0) failedWorkers++;
+        });
+    }
+    for (std::thread& t : readers) t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    int rendered = (int)doneFrames.size() - resumed;
+    std::cout << rendered << " frames in " << seconds << " s, " << rendered / std::max(seconds, 1e-6) << " frames/s." << std::endl;
+    if ((int)doneFrames.size() < opt.offlineFrames) {
+        std::cerr << opt.offlineFrames - (int)doneFrames.size() << " frame(s) unfinished"
+                  << (failedWorkers ? " after a worker failed" : "") << "; run the same command again to resume\n";
+        return -1;
+    }
+    fs::remove_all(dir / "claims", ec);
+    return 0;
+}
+
+const char* ALL_SCENES = "default,spheres10k,mesh1m,reflections,instances";
+
+// Scene names from a comma-separated list, where "all" stands for every fixed-seed scene
+std::vector<std::string> sceneNames(const char* request) {
+    std::string list = strcmp(request, "all") ? request : ALL_SCENES;
+    std::vector<std::string> names;
+    for (size_t pos = 0; pos <= list.size();) {
+        size_t comma = std::min(list.find(',', pos), list.size());
+        names.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    return names;
+}
+
+// Benchmark mode: renders each named scene for a fixed number of frames, time stepping
+// as in offline mode, and reports ray throughput per ray type and frame time percentiles
+int runBenchmark(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels) {
+    const int warmupFrames = 2;
+    std::vector<uint8_t> image(size_t(opt.width) * opt.height * 3);
+
+    std::ofstream json(opt.benchOut);
+    if (!json) {
+        std::cerr << "Cannot write " << opt.benchOut << "\n"; return -1;
+    }
+    json << "{\n  \"threads\": " << scheduler.threadCount()
+         << ",\n  \"simd\": \"" << (packetKernels ? packetKernels->name : "off")
+         << "\",\n  \"trace\": \"" << (useWavefront ? "wavefront" : "recursive")
+         << "\",\n  \"counters\": \"" << (RT2_STATS ? "on" : "compiled out")
+         << "\",\n  \"fast_math\": \"" << ((renderFeatures & RENDER_FAST_MATH) ? "on" : "off")
+         << "\",\n  \"width\": " << opt.width << ",\n  \"height\": " << opt.height
+         << ",\n  \"frames\": " << opt.benchFrames << ",\n  \"scenes\": [";
+
+    bool first = true;
+    for (const std::string& name : sceneNames(opt.benchScenes)) {
+        World world;
+        if (!makeNamedWorld(name, world)) {
+            std::cerr << "Unknown benchmark scene \"" << name << "\", expected one of " << ALL_SCENES << "\n"; return -1;
+        }
+        std::cout << "Benchmarking " << name << " (" << world.spheres.size() + world.scene.triangleCount()
+                  << " primitives, " << world.scene.instanceCount() << " instances, BVH built in " << world.bvh.buildMs << " ms)" << std::endl;
+
+        std::vector<double> frameMs;
+        double totalMs = 0.0;
+        RayStats totalStats;
+        for (int frame = 0; frame < warmupFrames + opt.benchFrames; ++frame) {
+            auto start = std::chrono::high_resolution_clock::now();
+            float time = frame * opt.timestep;
+            animateWorld(world, time);
+            Camera cam = orbitCamera(time * opt.orbitSpeed, float(opt.width) / float(opt.height), isPerspective);
+            RayStats frameStats;
+            renderFrame(scheduler, packetKernels, world, cam, opt.width, opt.height, image.data(), frameStats);
+            auto end = std::chrono::high_resolution_clock::now();
+            if (frame < warmupFrames) continue;
+            double ms = std::chrono::duration<double, std::milli>(end - start).count();
+            frameMs.push_back(ms);
+            totalMs += ms;
+            totalStats += frameStats;
+        }
+        std::sort(frameMs.begin(), frameMs.end());
+        double seconds = std::max(totalMs, 1e-6) / 1000.0;
+
+        json << (first ? "\n" : ",\n") << "    {\"name\": \"" << name << "\""
+             << ", \"primitives\": " << world.spheres.size() + world.scene.triangleCount()
+             << ", \"build_ms\": " << world.bvh.buildMs
+             << ", \"primary_rays_per_sec\": " << totalStats.primaryRays / seconds
+             << ", \"shadow_rays_per_sec\": " << totalStats.shadowRays / seconds
+             << ", \"reflection_rays_per_sec\": " << totalStats.reflectionRays / seconds
+             << ", \"median_frame_ms\": " << percentile(frameMs, 0.5)
+             << ", \"p95_frame_ms\": " << percentile(frameMs, 0.95) << "}";
+        first = false;
+        std::cout << "  median " << percentile(frameMs, 0.5) << " ms, p95 " << percentile(frameMs, 0.95) << " ms" << std::endl;
+    }
+    json << "\n  ]\n}\n";
+    json.close();
+    if (!json) {
+        std::cerr << "Failed to write " << opt.benchOut << "\n"; return -1;
+    }
+    std::cout << "Wrote " << opt.benchOut << std::endl;
+    return 0;
+}
+
+// Peak signal-to-noise ratio of two 8-bit images in dB; infinite when they are identical
+double psnr(const uint8_t* a, const uint8_t* b, size_t bytes) {
+    double sum = 0.0;
+    for (size_t i = 0; i < bytes; ++i) {
+        double d = double(a[i]) - double(b[i]);
+        sum += d * d;
+    }
+    if (sum == 0.0) return INFINITY;
+    return 10.0 * std::log10(255.0 * 255.0 / (sum / double(bytes)));
+}
+
+// Fast-math validation: renders the named scenes at several points of the orbit with the
+// precise and the fast shading and fails if any frame pair falls below FAST_MATH_MIN_PSNR
+const double FAST_MATH_MIN_PSNR = 50.0;
+
+int checkFastMath(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels) {
+    const int frames = 8;
+    const size_t imageSize = size_t(opt.width) * opt.height * 3;
+    std::vector<uint8_t> precise(imageSize), fast(imageSize);
+    const int features = renderFeatures;
+    double worst = INFINITY;
+
+    for (const std::string& name : sceneNames(opt.fastMathCheck)) {
+        World world;
+        if (!makeNamedWorld(name, world)) {
+            std::cerr << "Unknown scene \"" << name << "\", expected one of " << ALL_SCENES << "\n"; return -1;
+        }
+        double sceneWorst = INFINITY, preciseMs = 0.0, fastMs = 0.0;
+        for (int frame = 0; frame < frames; ++frame) {
+            float time = frame * 0.5f;
+            animateWorld(world, time);
+            Camera cam = orbitCamera(time * opt.orbitSpeed, float(opt.width) / float(opt.height), isPerspective);
+            RayStats stats;
+            for (bool useFast : {false, true}) {
+                renderFeatures = useFast ? features | RENDER_FAST_MATH : features & ~RENDER_FAST_MATH;
+                auto start = std::chrono::high_resolution_clock::now();
+                renderFrame(scheduler, packetKernels, world, cam, opt.width, opt.height, (useFast ? fast : precise).data(), stats);
+                auto end = std::chrono::high_resolution_clock::now();
+                (useFast ? fastMs : preciseMs) += std::chrono::duration<double, std::milli>(end - start).count();
+            }
+            sceneWorst = std::min(sceneWorst, psnr(precise.data(), fast.data(), imageSize));
+        }
+        std::cout << name << ": lowest PSNR " << sceneWorst << " dB, "
+                  << preciseMs / frames << " -> " << fastMs / frames << " ms/frame" << std::endl;
+        worst = std::min(worst, sceneWorst);
+    }
+    renderFeatures = features;
+
+    bool pass = worst >= FAST_MATH_MIN_PSNR;
+    std::cout << "Fast math " << (pass ? "passed" : "FAILED") << ": lowest PSNR " << worst
+              << " dB, threshold " << FAST_MATH_MIN_PSNR << " dB" << std::endl;
+    return pass ? 0 : 1;
+}
+
+// Encodes an RGB image (bottom row first) in memory; format is png, jpg, bmp or tga
+bool encodeImage(const std::string& format, int width, int height, const uint8_t* data, std::vector<uint8_t>& out) {
+    auto append = [](void* context, void* bytes, int size) {
+        std::vector<uint8_t>* buffer = static_cast<std::vector<uint8_t>*>(context);
+        buffer->insert(buffer->end(), static_cast<uint8_t*>(bytes), static_cast<uint8_t*>(bytes) + size);
+    };
+    out.clear();
+    if (format == "png") return stbi_write_png_to_func(append, &out, width, height, 3, data, width * 3) != 0;
+    if (format == "jpg") return stbi_write_jpg_to_func(append, &out, width, height, 3, data, 95) != 0;
+    if (format == "bmp") return stbi_write_bmp_to_func(append, &out, width, height, 3, data) != 0;
+    if (format == "tga") return stbi_write_tga_to_func(append, &out, width, height, 3, data) != 0;
+    return false;
+}
+
+#ifdef RT2_SERVICE
+// Render service: a long-running process that answers render requests on a local Unix
+// socket. Scenes and their BVHs are built on first use and kept, and framebuffers are
+// recycled, so a request only pays for tracing and encoding. The protocol is one text
+// line per request, any number of requests per connection:
+//   render scene=default time=1.5 angle=0.7 size=640x480 format=png projection=perspective
+// Every key is optional. The reply is "ok BYTES RENDER_MS\n" followed by BYTES bytes of
+// the encoded image, or "error MESSAGE\n". "shutdown" stops the service.
+struct RenderRequest {
+    std::string scene = "default";
+    float time = 0.f, angle = 0.f;
+    int width = 600, height = 600;
+    bool perspective = true;
+    std::string format = "png";
+};
+
+bool parseRenderRequest(const std::string& line, RenderRequest& req, std::string& error) {
+    size_t pos = line.find(' ');
+    while (pos != std::string::npos) {
+        size_t start = pos + 1;
+        pos = line.find(' ', start);
+        std::string field = line.substr(start, pos == std::string::npos ? std::string::npos : pos - start);
+        if (field.empty()) continue;
+        size_t eq = field.find('=');
+        std::string key = field.substr(0, eq), value = eq == std::string::npos ? "" : field.substr(eq + 1);
+        char* end = nullptr;
+        if (key == "scene") {
+            req.scene = value;
+        } else if (key == "time" || key == "angle") {
+            (key == "time" ? req.time : req.angle) = std::strtof(value.c_str(), &end);
+            if (value.empty() || *end) { error = "bad " + key + " \"" + value + "\""; return false; }
+        } else if (key == "size") {
+            if (sscanf(value.c_str(), "%dx%d", &req.width, &req.height) != 2 || req.width <= 0 || req.height <= 0 ||
+                req.width > 8192 || req.height > 8192) {
+                error = "bad size \"" + value + "\", expected WIDTHxHEIGHT up to 8192x8192"; return false;
+            }
+        } else if (key == "format") {
+            if (value != "png" && value != "jpg" && value != "bmp" && value != "tga") {
+                error = "bad format \"" + value + "\", expected png, jpg, bmp or tga"; return false;
+            }
+            req.format = value;
+        } else if (key == "projection") {
+            if (value != "perspective" && value != "ortho") {
+                error = "bad projection \"" + value + "\", expected perspective or ortho"; return false;
+            }
+            req.perspective = value == "perspective";
+        } else {
+            error = "unknown field \"" + key + "\""; return false;
+        }
+    }
+    return true;
+}
+
+class RenderService {
+public:
+    RenderService(TileScheduler& scheduler, const PacketKernels* packetKernels)
+        : scheduler(scheduler), packetKernels(packetKernels) {}
+    int run(const char* socketPath);
+
+private:
+    void serveConnection(int fd);
+    bool render(const RenderRequest& req, std::vector<uint8_t>& image, double& renderMs, std::string& error);
+    std::unique_ptr<std::vector<uint8_t>> takeBuffer();
+    void returnBuffer(std::unique_ptr<std::vector<uint8_t>> buffer);
+    void stop();
+
+    TileScheduler& scheduler;
+    const PacketKernels* packetKernels;
+    std::map<std::string, std::unique_ptr<World>> scenes; // warm scenes, built on first use
+    std::mutex renderMutex;                               // one frame at a time on the tile pool
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> buffers; // free framebuffers
+    std::mutex bufferMutex;
+
+    // Connection bookkeeping, for shutting down
+    std::mutex connMutex;
+    std::condition_variable connCv; // signalled when a connection closes
+    std::vector<int> openFds;
+    int listenFd = -1;
+    bool stopping = false;
+
+    // Reported about once per second
+    std::mutex statsMutex;
+    int intervalRequests = 0;
+    double intervalRenderMs = 0.0, intervalEncodeMs = 0.0;
+    std::chrono::high_resolution_clock::time_point intervalStart = std::chrono::high_resolution_clock::now();
+};
+
+std::unique_ptr<std::vector<uint8_t>> RenderService::takeBuffer() {
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    if (buffers.empty()) return std::make_unique<std::vector<uint8_t>>();
+    std::unique_ptr<std::vector<uint8_t>> buffer = std::move(buffers.back());
+    buffers.pop_back();
+    return buffer;
+}
+
+void RenderService::returnBuffer(std::unique_ptr<std::vector<uint8_t>> buffer) {
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    buffers.push_back(std::move(buffer));
+}
+
+// Animates the request's scene to its time and traces it; runs one request at a time,
+// since each frame already spreads over every worker of the tile pool
+bool RenderService::render(const RenderRequest& req, std::vector<uint8_t>& image, double& renderMs, std::string& error) {
+    std::lock_guard<std::mutex> lock(renderMutex);
+    std::unique_ptr<World>& world = scenes[req.scene];
+    if (!world) {
+        world = std::make_unique<World>();
+        if (!makeNamedWorld(req.scene, *world)) {
+            scenes.erase(req.scene);
+            error = "unknown scene \"" + req.scene + "\", expected one of " + ALL_SCENES;
+            return false;
+        }
+        std::cout << "Built scene " << req.scene << " in " << world->bvh.buildMs << " ms." << std::endl;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    animateWorld(*world, req.time);
+    Camera cam = orbitCamera(req.angle, float(req.width) / float(req.height), req.perspective);
+    image.resize(size_t(req.width) * req.height * 3);
+    RayStats stats;
+    renderFrame(scheduler, packetKernels, *world, cam, req.width, req.height, image.data(), stats);
+    renderMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    return true;
+}
+
+void RenderService::serveConnection(int fd) {
+    SocketReader reader(fd);
+    std::vector<uint8_t> encoded; // kept for the connection's lifetime
+    std::string line;
+    while (reader.readLine(line)) {
+        if (line == "shutdown") {
+            stop();
+            break;
+        }
+        RenderRequest req;
+        std::string error;
+        double renderMs = 0.0;
+        std::unique_ptr<std::vector<uint8_t>> image = takeBuffer();
+        bool ok = line.compare(0, 6, "render") == 0 && (line.size() == 6 || line[6] == ' ');
+        if (!ok) error = "expected \"render [key=value ...]\" or \"shutdown\"";
+        ok = ok && parseRenderRequest(line, req, error) && render(req, *image, renderMs, error);
+
+        // Encoding runs outside the render lock, overlapping the next request's tracing
+        auto encodeStart = std::chrono::high_resolution_clock::now();
+        if (ok && !encodeImage(req.format, req.width, req.height, image->data(), encoded)) {
+            ok = false;
+            error = "encoding failed";
+        }
+        double encodeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - encodeStart).count();
+        returnBuffer(std::move(image));
+
+        char header[128];
+        if (ok) snprintf(header, sizeof(header), "ok %zu %.3f\n", encoded.size(), renderMs);
+        std::string reply = ok ? std::string(header) : "error " + error + "\n";
+        if (!sendAll(fd, reply.data(), reply.size()) || (ok && !sendAll(fd, encoded.data(), encoded.size()))) break;
+        if (!ok) continue;
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        intervalRequests++;
+        intervalRenderMs += renderMs;
+        intervalEncodeMs += encodeMs;
+        auto now = std::chrono::high_resolution_clock::now();
+        double elapsed = std::chrono::duration<double>(now - intervalStart).count();
+        if (elapsed >= 1.0) {
+            std::cout << intervalRequests / elapsed << " requests/s, " << intervalRenderMs / intervalRequests
+                      << " ms render, " << intervalEncodeMs / intervalRequests << " ms encode" << std::endl;
+            intervalRequests = 0;
+            intervalRenderMs = intervalEncodeMs = 0.0;
+            intervalStart = now;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(connMutex);
+    openFds.erase(std::find(openFds.begin(), openFds.end(), fd));
+    close(fd);
+    connCv.notify_all();
+}
+
+// Wakes the accept loop and every connection blocked in recv
+void RenderService::stop() {
+    std::lock_guard<std::mutex> lock(connMutex);
+    stopping = true;
+    shutdown(listenFd, SHUT_RDWR);
+    for (int fd : openFds) shutdown(fd, SHUT_RDWR);
+}
+
+int RenderService::run(const char* socketPath) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path \"" << socketPath << "\" is too long\n"; return -1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath); // left behind by a service that did not shut down cleanly
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+        std::cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << "\n";
+        if (listenFd >= 0) close(listenFd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client hanging up mid-reply must not end the service
+    std::cout << "Serving render requests on " << socketPath << std::endl;
+
+    // One thread per connection; they are detached and counted through openFds
+    for (;;) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(connMutex);
+        if (stopping) {
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        openFds.push_back(fd);
+        std::thread(&RenderService::serveConnection, this, fd).detach();
+    }
+    std::unique_lock<std::mutex> lock(connMutex);
+    connCv.wait(lock, [&] { return openFds.empty(); });
+    close(listenFd);
+    unlink(socketPath);
+    std::cout << "Render service stopped." << std::endl;
+    return 0;
+}
+#endif
+
+#ifndef RT2_HEADLESS
+void framebuffer_size_callback(GLFWwindow* window, int width, int height){
+    glViewport(0, 0, width, height);
+}
+
+void processInput(GLFWwindow *window){
+    if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window,true);
+}
+
+// Streams rendered frames into an immutable texture through a ring of persistently
+// mapped pixel buffers. Each frame is rendered straight into the mapped memory of its
+// slot, glTexSubImage2D sources it from that buffer without stalling the CPU, and a
+// fence marks when the GPU has read it so the slot can be written again. The slots are
+// also the framebuffers of the render/present pipeline: one is being rendered while the
+// previous one is uploaded. Without ARB_buffer_storage/ARB_sync the slots are plain
+// CPU buffers.
+class TextureStreamer {
+public:
+    TextureStreamer(int width, int height);
+    ~TextureStreamer();
+    bool persistent() const { return usePBO; }
+    // Slot for the next frame; waits only if the GPU is still reading it.
+    // Must be called on the GL thread, but data(slot) may be written from any thread.
+    int acquire();
+    uint8_t* data(int slot) const { return mapped[slot]; }
+    // Queues the upload of a finished slot into the texture
+    void upload(int slot);
+
+private:
+    static const int SLOTS = 3;
+    int width, height;
+    size_t size;
+    bool usePBO;
+    GLuint texture = 0;
+    GLuint buffers[SLOTS] = {};
+    uint8_t* mapped[SLOTS] = {};
+    GLsync fences[SLOTS] = {};
+    int current = 0;
+    std::vector<uint8_t> fallback[SLOTS];
+};
+
+TextureStreamer::TextureStreamer(int width, int height) : width(width), height(height) {
+    size = size_t(width) * height * 3;
+    usePBO = GLEW_ARB_buffer_storage && GLEW_ARB_sync;
+
+    // Storage is allocated once; frames only ever replace its contents
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if (GLEW_ARB_texture_storage) glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB8, width, height);
+    else glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB rows are not padded to 4 bytes
+
+    if (!usePBO) {
+        for (int i = 0; i < SLOTS; ++i) {
+            fallback[i].resize(size);
+            mapped[i] = fallback[i].data();
+        }
+        return;
+    }
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(SLOTS, buffers);
+    for (int i = 0; i < SLOTS; ++i) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+        mapped[i] = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+TextureStreamer::~TextureStreamer() {
+    for (int i = 0; i < SLOTS; ++i) {
+        if (fences[i]) glDeleteSync(fences[i]);
+        if (usePBO && mapped[i]) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (usePBO) glDeleteBuffers(SLOTS, buffers);
+    glDeleteTextures(1, &texture);
+}
+
+int TextureStreamer::acquire() {
+    current = (current + 1) % SLOTS;
+    if (fences[current]) {
+        while (glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fences[current]);
+        fences[current] = nullptr;
+    }
+    return current;
+}
+
+void TextureStreamer::upload(int slot) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if (!usePBO) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, mapped[slot]);
+        return;
+    }
+    // With a buffer bound the data pointer is an offset into it
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[slot]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+int runWindowed(const Options& opt, TileScheduler& scheduler, const PacketKernels* packetKernels, World& world) {
+    // Initialize GLFW
+    if(!glfwInit()){
+        std::cerr << "Failed to init GLFW\n"; return -1;
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR,3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR,3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT,GL_TRUE);
+#endif
+
+    GLFWwindow* window=glfwCreateWindow(opt.width,opt.height,"First Hit Ray Tracer",NULL,NULL);
+    if(!window){
+        std::cerr << "Failed to create window\n"; glfwTerminate(); return -1;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetKeyCallback(window, key_callback);
+
+    // Init GLEW
+    glewExperimental=GL_TRUE;
+    if(glewInit() != GLEW_OK){
+        std::cerr << "Failed to init GLEW\n"; glfwTerminate(); return -1;
+    }
+
+    // Compile shaders
+    auto compileShader=[](GLenum type,const char* source){
+        GLuint shader=glCreateShader(type);
+        glShaderSource(shader,1,&source,nullptr);
+        glCompileShader(shader);
+        int success; char infoLog[512];
+        glGetShaderiv(shader,GL_COMPILE_STATUS,&success);
+        if(!success){
+            glGetShaderInfoLog(shader,512,nullptr,infoLog);
+            std::cerr << "Shader failed compilation:\n" << infoLog << "\n";
+        }
+        return shader;
+    };
+
+    GLuint vertShader=compileShader(GL_VERTEX_SHADER,vertexShaderSource);
+    GLuint fragShader=compileShader(GL_FRAGMENT_SHADER,fragmentShaderSource);
+
+    GLuint program=glCreateProgram();
+    glAttachShader(program,vertShader);
+    glAttachShader(program,fragShader);
+    glLinkProgram(program);
+    int success; char infoLog[512];
+    glGetProgramiv(program,GL_LINK_STATUS,&success);
+    if(!success){
+        glGetProgramInfoLog(program,512,nullptr,infoLog);
+        std::cerr << "Program linking failed:\n" << infoLog << "\n";
+    }
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+
+    float vertices[]={
+        // positions // Texture Coords
+        -1.f,  1.f, 0.f, 1.f,
+        -1.f, -1.f, 0.f, 0.f,
+         1.f, -1.f, 1.f, 0.f,
+        -1.f,  1.f, 0.f, 1.f,
+         1.f, -1.f, 1.f, 0.f,
+         1.f,  1.f, 1.f, 1.f
+    };
+
+    GLuint VAO,VBO;
+    glGenVertexArrays(1,&VAO);
+    glGenBuffers(1,&VBO);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER,VBO);
+    glBufferData(GL_ARRAY_BUFFER,sizeof(vertices),vertices,GL_STATIC_DRAW);
+    // Positions
+    glVertexAttribPointer(0,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(void*)0);
+    glEnableVertexAttribArray(0);
+    // TexCoords
+    glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,4*sizeof(float),(void*)(2*sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+
+    const int WIDTH=opt.width, HEIGHT=opt.height;
+    const size_t imageSize = size_t(WIDTH) * HEIGHT * 3;
+    std::unique_ptr<TextureStreamer> streamer = std::make_unique<TextureStreamer>(WIDTH, HEIGHT);
+    std::cout << "Texture upload: " << (streamer->persistent() ? "persistently mapped PBO ring" : "CPU buffer") << std::endl;
+    std::unique_ptr<FrameWriter> writer;
+    if (opt.dumpPattern) writer = std::make_unique<FrameWriter>(opt.encoderThreads, opt.writeQueueDepth);
+
+    float angle = 0.f;
+    float lastTime = glfwGetTime();
+    float statsTime = lastTime;
+    int statsFrames = 0;
+    double statsUpdateMs = 0.0;
+    RayStats intervalStats;
+    int frameNumber = 0, frameCount = 0;
+    std::ofstream statsFile;
+    if (opt.statsPath) statsFile.open(opt.statsPath);
+    glUseProgram(program);
+
+    // Frame N+1 is traced on the render thread while the GL thread presents frame N.
+    // Events are polled only while the render thread is idle, so key toggles never change
+    // a frame halfway; they reach the next frame started, one frame later on screen.
+    struct PipelinedFrame {
+        int slot;
+        std::vector<uint8_t>* dump; // writer buffer when dumping
+        RayStats stats;
+        double renderMs, updateMs;
+    };
+    RenderThread renderThread;
+    PipelinedFrame rendering = {}, ready = {};
+    bool haveReady = false;
+    ResolutionController resolution;
+    resolution.targetMs = opt.progressiveMs > 0.f ? 0.f : opt.targetFrameMs; // progressive mode keeps its own budget
+    std::vector<uint8_t> lowRes; // only touched by the render thread
+    ReprojectionCache cache;     // likewise
+    DirtyRegionCache dirtyCache; // likewise
+    ProgressiveRenderer progressive; // likewise
+    float sceneTime = lastTime;  // stands still while the spheres are paused
+
+    while(!glfwWindowShouldClose(window)){
+        // Time management for rotation
+        float currentTime = glfwGetTime();
+        float deltaTime = currentTime - lastTime;
+        lastTime = currentTime;
+        if (orbiting) angle += deltaTime * opt.orbitSpeed; // rotation
+        if (animating) sceneTime += deltaTime;
+
+        // Render straight into mapped texture memory. When dumping, render into a writer
+        // buffer instead and copy it over, since mapped memory is slow to read back.
+        rendering.slot = streamer->acquire();
+        rendering.dump = writer ? writer->acquire(imageSize) : nullptr;
+        Camera cam = orbitCamera(angle, float(WIDTH) / float(HEIGHT), isPerspective);
+        int renderWidth = resolution.width(WIDTH), renderHeight = resolution.height(HEIGHT);
+        renderThread.start([&, cam, sceneTime, renderWidth, renderHeight] {
+            auto renderStart = std::chrono::high_resolution_clock::now();
+            animateWorld(world, sceneTime);
+            rendering.updateMs = world.bvh.updateMs;
+            uint8_t* frame = streamer->data(rendering.slot);
+            uint8_t* target = rendering.dump ? rendering.dump->data() : frame;
+            rendering.stats = RayStats();
+            auto trace = [&](int w, int h, uint8_t* dst) {
+                if (opt.incremental) renderFrameIncremental(scheduler, packetKernels, world, cam, w, h, dst, rendering.stats, dirtyCache);
+                else if (opt.reproject) renderFrameCached(scheduler, packetKernels, world, cam, w, h, dst, rendering.stats, cache);
+                else if (opt.aaSamples > 0) renderFrameAA(scheduler, packetKernels, world, cam, w, h, opt.aaSamples, dst, rendering.stats);
+                else renderFrame(scheduler, packetKernels, world, cam, w, h, dst, rendering.stats);
+            };
+            if (opt.progressiveMs > 0.f) {
+                progressive.render(scheduler, packetKernels, world, cam, WIDTH, HEIGHT, opt.progressiveMs, ProgressiveRenderer::PASSES, target, rendering.stats);
+            } else if (renderWidth == WIDTH && renderHeight == HEIGHT) {
+                trace(WIDTH, HEIGHT, target);
+            } else {
+                // The camera keeps the window's aspect, so the small image just has fewer rays
+                lowRes.resize(size_t(renderWidth) * renderHeight * 3);
+                trace(renderWidth, renderHeight, lowRes.data());
+                upscaleEdgeAware(scheduler, lowRes.data(), renderWidth, renderHeight, target, WIDTH, HEIGHT);
+            }
+            if (rendering.dump) memcpy(frame, rendering.dump->data(), imageSize);
+            auto renderEnd = std::chrono::high_resolution_clock::now();
+            rendering.renderMs = std::chrono::duration<double, std::milli>(renderEnd - renderStart).count();
+        });
+
+        if (haveReady) {
+            // Update texture
+            streamer->upload(ready.slot);
+
+            glClearColor(0.2f,0.3f,0.3f,1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+
+            glBindVertexArray(VAO);
+            glDrawArrays(GL_TRIANGLES,0,6);
+            glBindVertexArray(0);
+
+            // Hand the frame to the encoder threads; the texture has its own copy
+            if (ready.dump) writer->submit(ready.dump, frameFilename(opt.dumpPattern, frameNumber++), WIDTH, HEIGHT);
+
+            glfwSwapBuffers(window);
+        }
+
+        renderThread.wait();
+        glfwPollEvents();
+        processInput(window);
+
+        intervalStats += rendering.stats;
+        statsUpdateMs += rendering.updateMs;
+        resolution.update(rendering.renderMs);
+        if (statsFile.is_open()) writeFrameStats(statsFile, frameCount, rendering.renderMs, rendering.stats);
+        frameCount++;
+        ready = rendering;
+        haveReady = true;
+
+        // Report BVH cost about once per second
+        statsFrames++;
+        if (currentTime - statsTime >= 1.f) {
+            printBVHStats(world, intervalStats, statsUpdateMs / statsFrames);
+            if (opt.aaSamples > 0)
+                printSampleBudget(intervalStats, uint64_t(resolution.width(WIDTH)) * resolution.height(HEIGHT) * statsFrames, opt.aaSamples);
+            std::cout << ", " << statsFrames / (currentTime - statsTime) << " fps";
+            if (opt.targetFrameMs > 0.f)
+                std::cout << ", rendering at " << resolution.width(WIDTH) << "x" << resolution.height(HEIGHT);
+            std::cout << std::endl;
+            intervalStats = RayStats();
+            statsUpdateMs = 0.0;
+            statsFrames = 0;
+            statsTime = currentTime;
+        }
+    }
+    // The last finished frame was never shown, but a dump should still include it
+    if (haveReady && ready.dump) writer->submit(ready.dump, frameFilename(opt.dumpPattern, frameNumber++), WIDTH, HEIGHT);
+    writer.reset(); // writes out whatever is still queued
+
+    // Cleanup
+    glDeleteVertexArrays(1,&VAO);
+    glDeleteBuffers(1,&VBO);
+    streamer.reset();
+    glDeleteProgram(program);
+
+    glfwTerminate();
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv){
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) && i + 1 < argc) {
+            opt.threadCount = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            opt.simdMode = argv[++i];
+        } else if (!strcmp(argv[i], "--offline") && i + 1 < argc) {
+            opt.offlineFrames = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2 || opt.width <= 0 || opt.height <= 0) {
+                std::cerr << "Invalid size \"" << argv[i] << "\", expected WIDTHxHEIGHT\n"; return -1;
+            }
+        } else if (!strcmp(argv[i], "--dt") && i + 1 < argc) {
+            opt.timestep = (float)std::atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            opt.outPattern = argv[++i];
+        } else if (!strcmp(argv[i], "--ortho")) {
+            isPerspective = false;
+        } else if (!strcmp(argv[i], "--recursive")) {
+            useWavefront = false;
+        } else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+            opt.dumpPattern = argv[++i];
+        } else if (!strcmp(argv[i], "--encoders") && i + 1 < argc) {
+            opt.encoderThreads = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--write-queue") && i + 1 < argc) {
+            opt.writeQueueDepth = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--reproject")) {
+            opt.reproject = true;
+        } else if (!strcmp(argv[i], "--incremental")) {
+            opt.incremental = true;
+        } else if (!strcmp(argv[i], "--progressive") && i + 1 < argc) {
+            opt.progressiveMs = (float)std::atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--progressive-passes") && i + 1 < argc) {
+            opt.progressivePasses = std::max(1, std::atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--aa") && i + 1 < argc) {
+            opt.aaSamples = std::atoi(argv[++i]);
+            int n = (int)std::lround(std::sqrt(float(opt.aaSamples)));
+            if (n * n != opt.aaSamples || n % 2 != 0 || n > 8) {
+                std::cerr << "--aa takes 4, 16, 36 or 64 samples per pixel\n"; return -1;
+            }
+        } else if (!strcmp(argv[i], "--no-shadows")) {
+            renderFeatures &= ~RENDER_SHADOWS;
+        } else if (!strcmp(argv[i], "--no-reflections")) {
+            renderFeatures &= ~RENDER_REFLECTIONS;
+        } else if (!strcmp(argv[i], "--no-specular")) {
+            renderFeatures &= ~RENDER_SPECULAR;
+        } else if (!strcmp(argv[i], "--fast-math")) {
+            renderFeatures |= RENDER_FAST_MATH;
+        } else if (!strcmp(argv[i], "--check-fast-math") && i + 1 < argc) {
+            opt.fastMathCheck = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            opt.servePath = argv[++i];
+        } else if (!strcmp(argv[i], "--obj") && i + 1 < argc) {
+            opt.objPath = argv[++i];
+        } else if (!strcmp(argv[i], "--obj-copies") && i + 1 < argc) {
+            opt.objCopies = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--tiled-output")) {
+            opt.tiledOutput = true;
+        } else if (!strcmp(argv[i], "--first-frame") && i + 1 < argc) {
+            opt.firstFrame = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--farm") && i + 1 < argc) {
+            opt.farmWorkers = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--farm-tiles") && i + 1 < argc) {
+            opt.farmBands = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--farm-dir") && i + 1 < argc) {
+            opt.farmDir = argv[++i];
+        } else if (!strcmp(argv[i], "--farm-worker") && i + 1 < argc) {
+            opt.farmWorker = true;
+            opt.farmDir = argv[++i];
+        } else if (!strcmp(argv[i], "--no-motion")) {
+            animating = false;
+        } else if (!strcmp(argv[i], "--orbit-speed") && i + 1 < argc) {
+            opt.orbitSpeed = (float)std::atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--target-ms") && i + 1 < argc) {
+            opt.targetFrameMs = (float)std::atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--stats") && i + 1 < argc) {
+            opt.statsPath = argv[++i];
+        } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            opt.benchScenes = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-frames") && i + 1 < argc) {
+            opt.benchFrames = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-out") && i + 1 < argc) {
+            opt.benchOut = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--simd auto|avx2|sse|scalar|off]\n"
+                      << "       [--offline FRAMES] [--first-frame N] [--size WxH] [--dt SECONDS] [--out PATTERN|none] [--ortho] [--recursive]\n"
+                      << "       [--tiled-output] [--obj FILE] [--obj-copies N]\n"
+                      << "       [--farm WORKERS] [--farm-tiles BANDS] [--farm-dir DIR]\n"
+                      << "       [--dump PATTERN] [--encoders N] [--write-queue N] [--stats FILE] [--target-ms MS]\n"
+                      << "       [--reproject] [--incremental] [--progressive MS] [--progressive-passes N] [--orbit-speed RAD_PER_S] [--no-motion]\n"
+                      << "       [--aa 4|16|36|64] [--no-shadows] [--no-reflections] [--no-specular]\n"
+                      << "       [--fast-math] [--check-fast-math all|SCENE,...] [--serve SOCKET]\n"
+                      << "       [--bench all|SCENE,...] [--bench-frames N] [--bench-out FILE]\n";
+            return -1;
+        }
+    }
+
+    if (opt.statsPath) {
+        if (!RT2_STATS) {
+            std::cerr << "--stats needs the ray counters, which this build compiles out (NDEBUG)\n"; return -1;
+        }
+        std::ofstream probe(opt.statsPath);
+        if (!probe) {
+            std::cerr << "Cannot write " << opt.statsPath << "\n"; return -1;
+        }
+    }
+
+    // Images are stored bottom row first, as glTexImage2D expects
+    stbi_flip_vertically_on_write(1);
+
+    if (opt.farmWorkers > 0 || opt.farmWorker) {
+        if (opt.offlineFrames <= 0 || !strcmp(opt.outPattern, "none")) {
+            std::cerr << "--farm renders offline frames to files, give --offline FRAMES and --out PATTERN\n"; return -1;
+        }
+        if (opt.reproject || opt.incremental || opt.progressiveMs > 0.f) {
+            std::cerr << "--farm renders frames independently, which rules out --reproject, --incremental and --progressive\n"; return -1;
+        }
+        int tileRows = (opt.height + RENDER_TILE - 1) / RENDER_TILE;
+        if (opt.farmBands < 1 || opt.farmBands > tileRows) {
+            std::cerr << "--farm-tiles must be between 1 and " << tileRows << " for this height\n"; return -1;
+        }
+        if (opt.farmBands > 1 && opt.aaSamples > 0) {
+            std::cerr << "--aa works on whole frames, use it without --farm-tiles\n"; return -1;
+        }
+        if (opt.farmDir.empty()) {
+            fs::path parent = fs::path(opt.outPattern).parent_path();
+            opt.farmDir = (parent.empty() ? fs::path("farm") : parent / "farm").string();
+        }
+    }
+    if (opt.farmWorkers > 0 && !opt.farmWorker) return runFarm(opt, argc, argv);
+    if (opt.tiledOutput) {
+        if (opt.offlineFrames <= 0 || opt.farmWorkers > 0 || opt.farmWorker) {
+            std::cerr << "--tiled-output applies to offline frames, give --offline FRAMES without --farm\n"; return -1;
+        }
+        if (opt.reproject || opt.incremental || opt.progressiveMs > 0.f || opt.aaSamples > 0) {
+            std::cerr << "--tiled-output traces each tile row once, which rules out --reproject, --incremental, --progressive and --aa\n"; return -1;
+        }
+    }
+
+    TileScheduler scheduler(opt.threadCount);
+    std::cout << "Rendering with " << scheduler.threadCount() << " thread(s)." << std::endl;
+
+    // Primary rays are traced in packets of 8 unless packets are turned off
+    const PacketKernels* packetKernels = nullptr;
+    if (strcmp(opt.simdMode, "off") != 0) {
+        packetKernels = selectPacketKernels(opt.simdMode);
+        if (!packetKernels) {
+            std::cerr << "SIMD mode \"" << opt.simdMode << "\" is not supported on this CPU\n"; return -1;
+        }
+        std::cout << "Primary ray packets: " << packetKernels->name << std::endl;
+    }
+
+    if (opt.benchScenes) {
+        if (opt.benchFrames <= 0) {
+            std::cerr << "--bench-frames must be positive\n"; return -1;
+        }
+        return runBenchmark(opt, scheduler, packetKernels);
+    }
+    if (opt.fastMathCheck) return checkFastMath(opt, scheduler, packetKernels);
+    if (opt.servePath) {
+#ifdef RT2_SERVICE
+        RenderService service(scheduler, packetKernels);
+        return service.run(opt.servePath);
+#else
+        std::cerr << "The render service needs Unix domain sockets, which this platform lacks\n";
+        return -1;
+#endif
+    }
+
+    World world = makeWorld();
+    if (opt.objPath) {
+        auto start = std::chrono::high_resolution_clock::now();
+        Mesh mesh;
+        std::string error;
+        if (!loadOBJ(opt.objPath, scheduler, mesh, error)) {
+            std::cerr << error << "\n"; return -1;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "Loaded " << opt.objPath << ": " << mesh.vertices.size() << " vertices, " << mesh.triangleCount()
+                  << " triangles in " << ms << " ms." << std::endl;
+        mesh.r = 220; mesh.g = 160; mesh.b = 60;
+        if (opt.objCopies <= 1) {
+            // Stands on the floor where the tetrahedron was
+            placeMesh(mesh, Vec3(1.5f, world.floor.point.y, 0.f), 1.2f);
+        } else {
+            // Copies in rows over the floor, each in a square cell of a grid 4 units wide
+            placeMesh(mesh, Vec3(0.f, 0.f, 0.f), 1.f);
+            int columns = (int)std::ceil(std::sqrt((double)opt.objCopies));
+            float cell = 4.f / columns;
+            for (int k = 0; k < opt.objCopies; ++k) {
+                Vec3 position(-2.f + cell * (k % columns + 0.5f), world.floor.point.y, -2.f + cell * (k / columns + 0.5f));
+                world.instances.push_back({0, Transform::place(position, 0.f, cell * 0.8f)});
+            }
+        }
+        world.meshes = {std::move(mesh)};
+        buildAccel(world);
+
+        // What stays resident: the scene's one copy of the triangles, and the BVHs over them
+        const CompiledScene& scene = world.scene;
+        size_t bvhBytes = 0;
+        for (const BVH* bvh : {&world.bvh.staticBVH, &world.bvh.dynamicBVH}) bvhBytes += bvh->nodes.size() * sizeof(BVHNode) + bvh->refs.size() * sizeof(PrimRef);
+        for (const BVH& bvh : scene.meshBVH) bvhBytes += bvh.nodes.size() * sizeof(BVHNode) + bvh.refs.size() * sizeof(PrimRef);
+        std::cout << "Triangles take " << double(scene.triangleBytes()) / scene.triangleCount() << " bytes each, and their BVH "
+                  << double(bvhBytes) / scene.triangleCount() << " more." << std::endl;
+    }
+    // Triangles of instanced meshes sit in their meshes' BVHs, not the scene BVH
+    const CompiledScene& scene = world.scene;
+    size_t topLevel = world.spheres.size() + scene.instanceCount(), meshLevel = 0, drawn = 0;
+    for (int m = 0; m < scene.meshCount(); ++m)
+        (scene.meshInstanced[m] ? meshLevel : topLevel) += scene.meshEnd(m) - scene.triangles.meshStart[m];
+    for (int k = 0; k < scene.instanceCount(); ++k) {
+        int m = scene.instances.mesh[k];
+        drawn += scene.meshEnd(m) - scene.triangles.meshStart[m];
+    }
+    std::cout << "Built BVH over " << topLevel << " primitives";
+    if (scene.instanceCount() > 0) {
+        std::cout << " (" << scene.instanceCount() << " of them instances) and mesh BVHs over " << meshLevel
+                  << " triangles that the instances draw as " << drawn << ",";
+    }
+    std::cout << " in " << world.bvh.buildMs << " ms." << std::endl;
+
+    if (opt.farmWorker) return runFarmWorker(opt, scheduler, packetKernels, world);
+    if (opt.offlineFrames > 0) {
+        return opt.tiledOutput ? runOfflineTiled(opt, scheduler, packetKernels, world) : runOffline(opt, scheduler, packetKernels, world);
+    }
+#ifdef RT2_HEADLESS
+    std::cerr << "This build has no window support, use --offline FRAMES\n";
+    return -1;
+#else
+    return runWindowed(opt, scheduler, packetKernels, world);
+#endif
+}
@@ -0,0 +1,137 @@
+// Load-testing client for the rt2 render service (rt2 --serve SOCKET).
+// Sends render requests over several connections at once and reports throughput and
+// latency percentiles. Each connection sends its share of the requests one after another.
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "rt2_net.h"
+#include "rt2_percentile.h"
+
+int connectTo(const char* socketPath) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " SOCKET [--requests N] [--connections N] [--dt SECONDS] [--out FILE]\n"
+                  << "       [--shutdown] [scene=NAME] [time=T] [angle=RAD] [size=WxH] [format=png|jpg|bmp|tga]\n"
+                  << "       [projection=perspective|ortho]\n";
+        return -1;
+    }
+    const char* socketPath = argv[1];
+    int requests = 1, connections = 1;
+    float dt = 0.f; // time step between requests, 0 repeats the same frame
+    const char* outPath = nullptr;
+    bool stopService = false;
+    std::string fields;
+    for (int i = 2; i < argc; ++i) {
+        if (!strcmp(argv[i], "--requests") && i + 1 < argc) requests = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--connections") && i + 1 < argc) connections = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--dt") && i + 1 < argc) dt = (float)std::atof(argv[++i]);
+        else if (!strcmp(argv[i], "--out") && i + 1 < argc) outPath = argv[++i];
+        else if (!strcmp(argv[i], "--shutdown")) stopService = true;
+        else if (strchr(argv[i], '=')) fields += std::string(" ") + argv[i];
+        else {
+            std::cerr << "Unknown argument \"" << argv[i] << "\"\n"; return -1;
+        }
+    }
+    if (dt != 0.f && fields.find(" time=") != std::string::npos) {
+        std::cerr << "--dt sets the time of each request, drop time=\n"; return -1;
+    }
+    requests = std::max(requests, 0);
+    connections = std::max(1, std::min(connections, std::max(requests, 1)));
+
+    std::mutex m;
+    std::vector<double> latencies;
+    std::vector<uint8_t> firstImage;
+    size_t totalBytes = 0;
+    int failures = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < connections; ++c) {
+        threads.emplace_back([&, c] {
+            int fd = connectTo(socketPath);
+            if (fd < 0) {
+                std::lock_guard<std::mutex> lock(m);
+                std::cerr << "Cannot connect to " << socketPath << "\n";
+                failures += (requests - c + connections - 1) / connections;
+                return;
+            }
+            SocketReader reader(fd);
+            std::vector<uint8_t> image;
+            std::string header;
+            for (int r = c; r < requests; r += connections) {
+                std::string line = "render" + fields;
+                if (dt != 0.f) line += " time=" + std::to_string(r * dt);
+                auto sent = std::chrono::high_resolution_clock::now();
+                size_t bytes = 0;
+                bool ok = sendAll(fd, line + "\n") && reader.readLine(header) &&
+                          sscanf(header.c_str(), "ok %zu", &bytes) == 1 && reader.readBytes(image, bytes);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - sent).count();
+
+                std::lock_guard<std::mutex> lock(m);
+                if (!ok) {
+                    if (failures++ == 0) std::cerr << "Request failed: " << (header.empty() ? "connection lost" : header) << "\n";
+                    if (header.compare(0, 6, "error ") != 0) break; // the connection is gone
+                    continue;
+                }
+                latencies.push_back(ms);
+                totalBytes += bytes;
+                if (r == 0) firstImage = image;
+            }
+            close(fd);
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        double mean = 0.0;
+        for (double ms : latencies) mean += ms;
+        mean /= latencies.size();
+        std::cout << latencies.size() << " requests over " << connections << " connection(s) in " << seconds << " s: "
+                  << latencies.size() / seconds << " requests/s, " << totalBytes / latencies.size() << " bytes/image\n"
+                  << "latency mean " << mean << " ms, p50 " << percentile(latencies, 0.5) << " ms, p95 "
+                  << percentile(latencies, 0.95) << " ms, p99 " << percentile(latencies, 0.99) << " ms, max "
+                  << latencies.back() << " ms" << std::endl;
+    }
+    if (outPath && !firstImage.empty()) {
+        std::ofstream out(outPath, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(firstImage.data()), firstImage.size());
+        if (!out) {
+            std::cerr << "Cannot write " << outPath << "\n"; failures++;
+        }
+    }
+    if (stopService) {
+        int fd = connectTo(socketPath);
+        if (fd < 0 || !sendAll(fd, "shutdown\n")) {
+            std::cerr << "Cannot reach " << socketPath << " to shut it down\n"; failures++;
+        }
+        if (fd >= 0) close(fd);
+    }
+    if (failures > 0) std::cerr << failures << " request(s) failed\n";
+    return failures > 0 ? 1 : 0;
+}
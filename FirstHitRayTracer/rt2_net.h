@@ -0,0 +1,70 @@
+// Pieces shared by the render service in rt2.cpp and its load-testing client rt2_client.cpp,
+// so both ends frame the protocol the same way: request and reply header lines end in '\n'
+// (a '\r' before it is dropped), and an "ok BYTES ..." header is followed by BYTES of image.
+#ifndef RT2_NET_H
+#define RT2_NET_H
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Buffered line and byte reads from a socket
+struct SocketReader {
+    static constexpr size_t MAX_LINE = 4096;
+
+    int fd;
+    char buffer[4096];
+    size_t pos = 0, len = 0;
+
+    explicit SocketReader(int fd) : fd(fd) {}
+    bool fill() {
+        if (pos < len) return true;
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        pos = 0; len = size_t(n);
+        return true;
+    }
+    // False when the connection ends first or the line is longer than MAX_LINE
+    bool readLine(std::string& line) {
+        line.clear();
+        for (;;) {
+            if (!fill()) return false;
+            char c = buffer[pos++];
+            if (c == '\n') return true;
+            if (c != '\r') line += c;
+            if (line.size() > MAX_LINE) return false;
+        }
+    }
+    bool readBytes(std::vector<uint8_t>& out, size_t size) {
+        out.resize(size);
+        for (size_t done = 0; done < size;) {
+            if (!fill()) return false;
+            size_t n = std::min(size - done, len - pos);
+            memcpy(out.data() + done, buffer + pos, n);
+            pos += n; done += n;
+        }
+        return true;
+    }
+};
+
+inline bool sendAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, 0);
+        if (n <= 0) return false;
+        p += n; size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool sendAll(int fd, const std::string& data) {
+    return sendAll(fd, data.data(), data.size());
+}
+#endif
+
+#endif
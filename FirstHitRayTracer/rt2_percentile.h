@@ -0,0 +1,15 @@
+// Latency and frame-time percentiles, shared by the benchmark in rt2.cpp and rt2_client.cpp
+#ifndef RT2_PERCENTILE_H
+#define RT2_PERCENTILE_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Nearest-rank percentile of an ascending list
+inline double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+#endif